@@ -0,0 +1,12 @@
+
+#ifndef CRC32_SW_H_
+#define CRC32_SW_H_
+
+#include <stdint.h>
+
+// CRC-32 (zlib/Ethernet) in software, slicing-by-8. same calling convention
+// as crc32(): start is 0 or the result over what came before. plain C on
+// purpose, tools/crc32_bench.c builds it for the host too.
+uint32_t crc32_sw(uint32_t start, const void* addr, uint32_t len);
+
+#endif
@@ -29,6 +29,8 @@
 void Delay_Init(void);
 void Delay_Us (uint32_t n);
 void Delay_Ms (uint32_t n);
+uint32_t Delay_GetTicks(void);
+uint32_t Delay_TicksToUs(uint32_t ticks);
 void uart_init_dbg(void);
 
 #ifndef DEBUG
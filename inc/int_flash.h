@@ -0,0 +1,18 @@
+
+#ifndef INT_FLASH_H_
+#define INT_FLASH_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// scratch area at the end of the MCU's own flash (STAGE in Link.ld), big
+// enough to hold one 32 KiW cart sector
+#define INT_FLASH_STAGE_SIZE   (64*1024)
+#define INT_FLASH_PAGE_SIZE    256 /* fast program/erase granularity */
+
+const uint16_t* int_flash_stage_data(void);
+
+void int_flash_stage_erase(void);
+bool int_flash_stage_program(uint32_t off, const uint32_t page[INT_FLASH_PAGE_SIZE/4]);
+
+#endif
@@ -25,16 +25,19 @@ inline static bool irq_is_enabled(void) {
 	return (mstatus & 8) != 0;
 }
 
+// nests: IRQs only come back on if they were on when it was entered
 #define CRITICAL_SECTION(...) do { \
-		/*register bool __a = irq_is_enabled();*/ \
-		/*asm volatile("csrrci %0, mstatus, 8":"=r"(__a));*/ \
+		bool __irq_was_on = irq_is_enabled(); \
 		__disable_irq(); \
 		do { __VA_ARGS__; } while (0); \
-		if (/*__a|*/1) __enable_irq(); \
+		if (__irq_was_on) __enable_irq(); \
 	} while (0) \
 
 void hexdump(const void* src, size_t len);
 
+// CRC-32 (zlib/Ethernet), slicing-by-8 or the CRC unit, whichever
+// crc32_init() found faster. same result either way.
+void crc32_init(void);
 uint32_t crc32(uint32_t start, const void* addr, uint32_t len);
 
 #endif
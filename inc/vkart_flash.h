@@ -5,20 +5,107 @@
 #include <stdint.h>
 #include <stdbool.h>
 
-#define VKART_MEMORY_WORDSZ    (128*32*1024 /* 128 pages of 32 KiW each */)
+#define VKART_MEMORY_WORDSZ    (128*32*1024 /* A0..A21, the most the cart bus can address */)
 #define VKART_BUFFER_WORDSZ    (4096 /* small page size; also max size we can buffer */)
 
 extern uint16_t vkart_data_buffer[VKART_BUFFER_WORDSZ];
 
+enum vkart_wrimage_mode {
+	VKART_WRIMAGE_INCREMENTAL = 0, // per-sector blank/same checks, erase as needed
+	VKART_WRIMAGE_CHIP_ERASE,      // erase the whole chip up front, then only program
+};
+
+enum vkart_wrimage_status {
+	VKART_WRIMAGE_MORE = 0, // ready for the next chunk
+	VKART_WRIMAGE_BUSY,     // erasing or catching up: poll, then hand over what wasn't taken
+	VKART_WRIMAGE_END,      // end of the flash reached, rest is dropped
+	VKART_WRIMAGE_ERR_PROG, // the chip reported a program failure
+	VKART_WRIMAGE_ERR_ERASE,// the chip reported an erase failure
+};
+
+enum vkart_read_engine {
+	VKART_READ_CPU = 0, // bit-banged
+	VKART_READ_DMA,     // timer paced DMA, the CPU is free while it runs
+};
+
+enum vkart_erase_status {
+	VKART_ERASE_DONE = 0,
+	VKART_ERASE_BUSY,
+	VKART_ERASE_FAILED,
+};
+
+// from CFI at init, or the datasheets of the parts we know if it's missing
+struct vkart_geometry {
+	uint32_t words;          // usable size, at most VKART_MEMORY_WORDSZ
+	uint16_t sectors;
+	uint16_t wbuf_words;     // write buffer size, 0 if none
+	uint32_t word_prog_us;   // typical times, 0 if unknown
+	uint32_t buf_prog_us;
+	uint32_t sector_erase_ms;
+	uint32_t chip_erase_ms;
+};
+
+// a sector that didn't read back right even after rewriting it, the host can
+// resend it with vkart_wrimage_repair()
+#define VKART_BAD_SECTORS_MAX 16
+struct vkart_bad_sector {
+	uint32_t addr; // in words
+	uint32_t len;  // in words, what the image had there
+	uint32_t crc;  // crc32() of that data
+	uint8_t tries; // resends so far
+};
+
+// counters for the current (or last) wrimage session
+struct vkart_stats {
+	uint32_t sectors_erased;
+	uint32_t erase_us_total;
+	uint32_t erase_us_max; // longest single erase command
+	uint32_t words_programmed;
+	uint32_t words_skipped; // 0xffff, nothing to program
+	uint32_t irq_off_us_max; // longest the bus kept IRQs masked
+	uint32_t sectors_verified; // read back and matched what was written
+	uint32_t sectors_bad;
+	uint32_t first_bad_addr; // in words, if sectors_bad
+	uint32_t sectors_repaired; // bad at first, fine after a rewrite or resend
+};
+extern struct vkart_stats vkart_stats;
+
 
 bool vkart_init(void);
+const struct vkart_geometry* vkart_get_geometry(void);
 void vkart_read_data(uint32_t addr, uint16_t *pbuff, uint32_t len);
-void vkart_erase_sector(uint32_t addr, uint8_t block);
-void vkart_write_data(const uint16_t* pbuf, uint32_t address, uint32_t len);
+void vkart_set_read_engine(enum vkart_read_engine engine);
+// background read, vkart_read_poll() until it returns true. nothing else may
+// use the cart in between, except vkart_read_data() which waits its turn.
+void vkart_read_start(uint32_t addr, uint16_t* pbuff, uint32_t len);
+bool vkart_read_poll(void);
+bool vkart_erase_sector(uint32_t addr, uint16_t block, uint32_t* time_us);
+bool vkart_erase_sectors(const uint32_t* addrs, uint32_t n, uint32_t* time_us);
+// background erase of up to 8 sectors, poll until it's no longer BUSY
+bool vkart_erase_start(const uint32_t* addrs, uint32_t n);
+enum vkart_erase_status vkart_erase_poll(void);
+bool vkart_write_data(const uint16_t* pbuf, uint32_t address, uint32_t len);
+
+// with len_hint 0 sectors get erased one at a time, the multi-sector erase
+// only takes sectors up to what it knows the image covers
+bool vkart_wrimage_start(uint32_t len_hint /* in words, 0 if unknown */, enum vkart_wrimage_mode mode);
+enum vkart_wrimage_status vkart_wrimage_poll(void);
+enum vkart_wrimage_status vkart_wrimage_next(const uint16_t* pbuf, uint32_t len);
+uint32_t vkart_wrimage_pos(void); // words taken so far, to resume after BUSY
+// a step of what vkart_wrimage_finish() waits for: running erase, write-back,
+// readbacks. true once there's nothing left, finish is quick after that.
+bool vkart_wrimage_drain(void);
+// false while any sector of the image doesn't read back right, see
+// vkart_wrimage_bad_sectors()
+bool vkart_wrimage_finish(void);
+// rewrite one bad sector of the last image, its data comes in through
+// vkart_wrimage_next() like for a full image. false once it's out of tries.
+bool vkart_wrimage_repair(uint32_t addr);
+const struct vkart_bad_sector* vkart_wrimage_bad_sectors(uint32_t* n);
 
-bool vkart_wrimage_start(void);
-bool vkart_wrimage_next(const uint16_t* pbuf, uint32_t len);
-void vkart_wrimage_finish(void);
+#ifdef VKART_BENCH
+void vkart_bench(void);
+#endif
 
 #endif /* USER_VKART__FLASH_C_ */
 
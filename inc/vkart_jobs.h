@@ -0,0 +1,51 @@
+
+#ifndef VKART_JOBS_H_
+#define VKART_JOBS_H_
+
+#include <stdint.h>
+#include <stdbool.h>
+
+// queue of cart operations, advanced a little bit at a time from the main
+// loop so USB keeps getting serviced while the flash is busy
+
+#define VKART_JOB_QUEUE_LEN 4
+
+enum vkart_job_type {
+	VKART_JOB_PROGRAM = 0, // next part of the image, through vkart_wrimage_next()
+	VKART_JOB_ERASE,       // the sector at addr
+	VKART_JOB_READ,        // len words from addr into dst
+	VKART_JOB_FLUSH,       // the image is all in: wait out erases, write-backs and readbacks
+};
+
+enum vkart_job_result {
+	VKART_JOB_OK = 0,
+	VKART_JOB_END,       // program: end of the flash reached, rest was dropped
+	VKART_JOB_ERR_PROG,
+	VKART_JOB_ERR_ERASE,
+};
+
+struct vkart_job;
+typedef void (*vkart_job_cb)(struct vkart_job* job, enum vkart_job_result res);
+
+struct vkart_job {
+	uint8_t type; // vkart_job_type
+	uint32_t addr; // in words, erase & read
+	uint32_t len;  // in words, program & read
+	const uint16_t* src;
+	uint16_t* dst;
+	vkart_job_cb done; // called from vkart_job_task(), may submit the job again
+
+	// owned by the queue
+	uint32_t off;
+	bool started;
+};
+
+// the job has to stay around (and its buffers valid) until its callback ran
+bool vkart_job_submit(struct vkart_job* job);
+void vkart_job_task(void);
+bool vkart_job_idle(void);
+// drop everything queued, without callbacks. a running erase keeps going,
+// vkart_wrimage_finish() waits it out.
+void vkart_job_flush(void);
+
+#endif
@@ -7,6 +7,9 @@ BUILD_DIR    := ./bin
 SDK_LOCATION := ./sdk
 SRC_DIRS     := ./src ./src/usb $(SDK_LOCATION)/src
 INC_DIRS     := ./inc $(SDK_LOCATION)/inc
+GEN_DIR      := $(BUILD_DIR)/gen
+GEN_HEADERS  := $(GEN_DIR)/crc32_tables.h
+HOSTCC       ?= cc
 STARTUP_FILE := $(SDK_LOCATION)/Startup/startup_ch32v30x_D8C.S
 LIB_DIRS     := 
 LIBS         := 
@@ -14,6 +17,10 @@ CXXFLAGS     :=
 CFLAGS       := -Wall -msmall-data-limit=8 -msave-restore -Os -fmessage-length=0 -fsigned-char -ffunction-sections -fdata-sections -fno-common
 # enable ASAN:
 #CFLAGS       += -fsanitize=kernel-address -DMcuASAN_CONFIG_IS_ENABLED=1
+# print cart bus benchmarks at boot:
+#CFLAGS       += -DVKART_BENCH
+# most words moved on the cart bus with IRQs masked (default 64):
+#CFLAGS       += -DVKART_IRQ_CHUNK_WORDS=32
 LDFLAGS      := -static -nostartfiles -Wl,--gc-sections -Wl,--cref
 TOOLCHAIN_PREFIX := riscv32-unknown-elf-
 AS := $(TOOLCHAIN_PREFIX)as
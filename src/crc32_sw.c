@@ -0,0 +1,26 @@
+#include <stdint.h>
+
+#include "crc32_sw.h"
+#include "crc32_tables.h" // crc32_tables[8][256] from tools/crc32_gen.c
+
+#define T crc32_tables
+
+uint32_t crc32_sw(uint32_t start, const void* addr, uint32_t len) {
+	const uint8_t* p = addr;
+	uint32_t crc = start ^ 0xFFFFFFFFu;
+
+	// bytes up to the first aligned word, then 8 at a time with two word
+	// loads (little endian, so the first byte is in the low bits)
+	for (; len && ((uintptr_t)p & 3); --len)
+		crc = (crc >> 8) ^ T[0][(crc ^ *p++) & 0xff];
+	for (; len >= 8; len -= 8, p += 8) {
+		uint32_t a = *(const uint32_t*)p ^ crc;
+		uint32_t b = *(const uint32_t*)(p + 4);
+		crc = T[7][a & 0xff] ^ T[6][(a >> 8) & 0xff] ^ T[5][(a >> 16) & 0xff] ^ T[4][a >> 24]
+			^ T[3][b & 0xff] ^ T[2][(b >> 8) & 0xff] ^ T[1][(b >> 16) & 0xff] ^ T[0][b >> 24];
+	}
+	for (; len; --len)
+		crc = (crc >> 8) ^ T[0][(crc ^ *p++) & 0xff];
+
+	return crc ^ 0xFFFFFFFFu;
+}
@@ -142,30 +142,36 @@ static uint16_t p_ms = 0;
 NO_ASAN_PUBLIC void Delay_Init(void) {
 	p_us = SystemCoreClock / 8000000;
 	p_ms = (uint16_t)p_us * 1000;
+
+	// free-running up-counter at HCLK/8, shared by the delays and timestamps
+	SysTick->CTLR = 0;
+	SysTick->SR &= ~(1 << 0);
+	SysTick->CNT = 0;
+	SysTick->CTLR = (1 << 0);
+}
+
+NO_ASAN_PUBLIC uint32_t Delay_GetTicks(void) {
+	return (uint32_t)SysTick->CNT; // low half is enough, wraps after ~4 minutes
+}
+
+NO_ASAN_PUBLIC uint32_t Delay_TicksToUs(uint32_t ticks) {
+	return ticks / p_us;
 }
 
 NO_ASAN_PUBLIC void Delay_Us(uint32_t n) {
-	SysTick->SR &= ~(1 << 0);
+	uint32_t start = Delay_GetTicks();
 	uint32_t i = (uint32_t)n * p_us;
 
-	SysTick->CMP = i;
-	SysTick->CTLR |= (1 << 4) | (1 << 5) | (1 << 0);
-
-	while((SysTick->SR & (1 << 0)) != (1 << 0))
+	while (Delay_GetTicks() - start < i)
 		;
-	SysTick->CTLR &= ~(1 << 0);
 }
 
 NO_ASAN_PUBLIC void Delay_Ms(uint32_t n) {
-	SysTick->SR &= ~(1 << 0);
+	uint32_t start = Delay_GetTicks();
 	uint32_t i = (uint32_t)n * p_ms;
 
-	SysTick->CMP = i;
-	SysTick->CTLR |= (1 << 4) | (1 << 5) | (1 << 0);
-
-	while((SysTick->SR & (1 << 0)) != (1 << 0))
+	while (Delay_GetTicks() - start < i)
 		;
-	SysTick->CTLR &= ~(1 << 0);
 }
 
 NO_ASAN_PUBLIC void *_sbrk(ptrdiff_t incr) {
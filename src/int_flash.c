@@ -0,0 +1,32 @@
+
+#include <string.h>
+
+#include "ch32v30x.h"
+#include "int_flash.h"
+
+extern const char _stage_start[], _stage_end[];
+
+// the fast erase/program registers want the 0x08000000 alias of the code flash
+#define STAGE_ADDR (0x08000000u + (uint32_t)_stage_start)
+
+const uint16_t* int_flash_stage_data(void) {
+	return (const uint16_t*)STAGE_ADDR;
+}
+
+void int_flash_stage_erase(void) {
+	FLASH_Unlock_Fast();
+	for (uint32_t off = 0; off < INT_FLASH_STAGE_SIZE; off += 32*1024) {
+		FLASH_EraseBlock_32K_Fast(STAGE_ADDR + off);
+	}
+	FLASH_Lock_Fast();
+}
+
+bool int_flash_stage_program(uint32_t off, const uint32_t page[INT_FLASH_PAGE_SIZE/4]) {
+	if (off >= INT_FLASH_STAGE_SIZE || (off & (INT_FLASH_PAGE_SIZE-1))) return false;
+
+	FLASH_Unlock_Fast();
+	FLASH_ProgramPage_Fast(STAGE_ADDR + off, (uint32_t*)page);
+	FLASH_Lock_Fast();
+
+	return !memcmp((const void*)(STAGE_ADDR + off), page, INT_FLASH_PAGE_SIZE);
+}
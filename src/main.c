@@ -2,7 +2,9 @@
 #include <stdio.h>
 
 #include "debug.h"
+#include "util.h"
 #include "vkart_flash.h"
+#include "vkart_jobs.h"
 #include "ch32v30x.h"
 #include "led_blinker.h"
 #include "tusb_app.h"
@@ -19,6 +21,7 @@ int main(void) {
 
 	uart_init_dbg();
 	Delay_Ms(10);
+	crc32_init();
 
 	//iprintf("USBD Udisk\r\nStorage Medium: VKART Flash\r\n");
 	//iprintf("SystemClk:%ld\r\n",SystemCoreClock);
@@ -36,11 +39,15 @@ int main(void) {
 	}
 
 	iprintf("inited vkart\r\n");
+#ifdef VKART_BENCH
+	vkart_bench();
+#endif
 	led_blinker_set(led_waiting);
 	tusb_app_init();
 
 	while (1) {
 		tusb_app_task();
+		vkart_job_task();
 	}
 }
 
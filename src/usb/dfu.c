@@ -11,6 +11,8 @@
 #include "util.h"
 #include "led_blinker.h"
 #include "vkart_flash.h"
+#include "vkart_jobs.h"
+#include "dfu.h"
 
 
 // DFU -- internal state
@@ -18,21 +20,69 @@
 struct state {
 	uint32_t offset;
 	uint32_t maxlen;
-	uint32_t crcacc;
 	enum action { act_none = 0, act_upload = 1, act_download = 2 } curact;
 	bool stop;
+	bool erasing; // chip erase running, block 0 waits in the job queue until it's done
+	bool ack_held; // both buffers busy, the last block gets its status once one frees up
+	bool manifest_held; // manifest came in, flush_job is getting everything done first
+	uint8_t dl_next; // download buffer the next block goes into
+	uint8_t dl_status; // a block we already acked failed, tell the host next time
+	bool read_ahead; // upload: dl_bufs[0] has (or is getting) the block at its offset
 } state;
 
-#define CRC32_INITIAL (~(uint32_t)0)
+// downloaded blocks are copied here and acked right away, so the host can
+// send the next one while the previous one is still being programmed. an
+// upload reads the next block ahead into the first one, see read_ahead().
+static struct dl_buf {
+	struct vkart_job job; // first, download_done() gets back here from it
+	uint32_t offset;
+	bool busy;
+	uint8_t data[CFG_TUD_DFU_XFER_BUFSIZE] __attribute__((__aligned__(4)));
+} dl_bufs[2];
+// queued behind the last blocks at manifest, see flush_done()
+static struct vkart_job flush_job;
+
+// image length announced by the host before a download, 0 if it didn't.
+// it's the only way the device learns how far the image goes before the data
+// gets there, without it the erase look-ahead (several sectors per erase
+// command) never has anything past the current block to take along. a stock
+// DFU host doesn't send it, so it gets one sector per erase.
+static uint32_t image_len_hint;
+// sector the next download rewrites instead of a whole image, in words
+static uint32_t repair_addr;
+static bool repair_next;
+
+// what VREQ_GET_BAD_SECTORS sends back, offsets and lengths in bytes
+struct bad_sector_report {
+	uint32_t offset;
+	uint32_t len;
+	uint32_t crc;
+	uint32_t tries;
+};
+static struct bad_sector_report bad_report[VKART_BAD_SECTORS_MAX];
+
+// vendor requests (device recipient, no data stage unless noted)
+enum vendor_request {
+	VREQ_SET_IMAGE_LEN = 1, // wIndex:wValue = length of the next download in bytes, see image_len_hint
+	VREQ_SET_READ_ENGINE = 2, // wValue = enum vkart_read_engine
+	VREQ_GET_BAD_SECTORS = 3, // IN: struct bad_sector_report[] of the last download
+	VREQ_REPAIR_SECTOR = 4, // wIndex:wValue = byte offset, the next download resends only that sector
+};
 
 // DFU -- internal fuctions
 
 static bool init_base(void) {
 	state.offset = 0;
-	state.maxlen = VKART_MEMORY_WORDSZ<<1;
-	state.crcacc = CRC32_INITIAL;
+	state.maxlen = vkart_get_geometry()->words<<1;
 	state.curact = act_none;
 	state.stop = false;
+	state.erasing = false;
+	state.ack_held = false;
+	state.manifest_held = false;
+	state.dl_next = 0;
+	state.dl_status = DFU_STATUS_OK;
+	state.read_ahead = false;
+	dl_bufs[0].busy = dl_bufs[1].busy = false;
 
 	return true;
 }
@@ -54,12 +104,34 @@ err:
 	tud_dfu_finish_flashing(DFU_STATUS_ERR_FILE);
 	return false;
 }
+static void read_ahead_done(struct vkart_job* j, enum vkart_job_result res) {
+	(void)res;
+	((struct dl_buf*)j)->busy = false;
+}
+// queue up a read of the block the host will most likely ask for next, the
+// main loop does it through the read engine while USB waits for the host
+static void read_ahead(uint16_t len) {
+	struct dl_buf* buf = &dl_bufs[0];
+
+	if (state.offset + len > state.maxlen) len = state.maxlen - state.offset;
+	if (!len) return;
+
+	buf->offset = state.offset;
+	buf->job.type = VKART_JOB_READ;
+	buf->job.addr = state.offset >> 1;
+	buf->job.len = len >> 1;
+	buf->job.dst = (uint16_t*)buf->data;
+	buf->job.done = read_ahead_done;
+	buf->busy = state.read_ahead = vkart_job_submit(&buf->job);
+}
 static void deinit_upload(void) {
 	iprintf("[DFU] deinit upload\r\n");
+	while (!vkart_job_idle()) vkart_job_task(); // a read ahead still going
+	dl_bufs[0].busy = false;
 	led_blinker_set(led_waiting);
 	state.curact = act_none;
 }
-static bool init_download(void) {
+static bool init_download(uint8_t alt) {
 	if (state.curact != act_none) {
 		tud_dfu_finish_flashing(DFU_STATUS_ERR_UNKNOWN);
 		return false;
@@ -69,13 +141,31 @@ static bool init_download(void) {
 
 	iprintf("[DFU] init download\r\n");
 
-	if (!vkart_wrimage_start()) {
+	uint32_t hint = image_len_hint;
+	image_len_hint = 0; // only good for one download
+	enum vkart_wrimage_mode mode = (alt == ALT_CHIP_ERASE && !repair_next)
+		? VKART_WRIMAGE_CHIP_ERASE : VKART_WRIMAGE_INCREMENTAL;
+	if (repair_next) {
+		repair_next = false;
+		if (!vkart_wrimage_repair(repair_addr)) {
+			iprintf("[DFU] can't repair %08lx!\r\n", repair_addr << 1);
+
+			goto err;
+		}
+
+		uint32_t n;
+		const struct vkart_bad_sector* bad = vkart_wrimage_bad_sectors(&n);
+		for (uint32_t i = 0; i < n; ++i) {
+			if (bad[i].addr == repair_addr) state.maxlen = bad[i].len << 1;
+		}
+	} else if (!vkart_wrimage_start(hint >> 1, mode)) {
 		iprintf("[DFU] can't start DL!\r\n");
 
 		goto err;
 	}
 
 	state.curact = act_download;
+	state.erasing = mode == VKART_WRIMAGE_CHIP_ERASE;
 	led_blinker_set(led_writing);
 	return true;
 
@@ -86,11 +176,101 @@ err:
 }
 static void deinit_download(void) {
 	iprintf("[DFU] deinit download\r\n");
+	vkart_job_flush();
 	vkart_wrimage_finish();
 	led_blinker_set(led_waiting);
 	state.curact = act_none;
+	state.erasing = false;
+	dl_bufs[0].busy = dl_bufs[1].busy = false;
+}
+
+static void start_manifest(void);
+static void download_done(struct vkart_job* j, enum vkart_job_result res) {
+	struct dl_buf* buf = (struct dl_buf*)j;
+
+	buf->busy = false;
+	state.erasing = false;
+	if (res == VKART_JOB_ERR_PROG || res == VKART_JOB_ERR_ERASE) {
+		iprintf("[DFU] %s failed at %08lx\r\n",
+				(res == VKART_JOB_ERR_PROG) ? "program" : "erase", buf->offset);
+		state.dl_status = (res == VKART_JOB_ERR_PROG) ? DFU_STATUS_ERR_PROG : DFU_STATUS_ERR_ERASE;
+		// the other buffer won't be needed anymore
+		vkart_job_flush();
+		dl_bufs[0].busy = dl_bufs[1].busy = false;
+	} else if (res == VKART_JOB_END) {
+		state.stop = true;
+	}
+	//iprintf("[DFU] write done\r\n");
+
+	if (state.dl_status != DFU_STATUS_OK && (state.ack_held || state.manifest_held)) {
+		uint8_t status = state.dl_status;
+		deinit_download();
+		tud_dfu_finish_flashing(status);
+	} else if (state.ack_held) {
+		// flashing op for download complete without error
+		state.ack_held = false;
+		tud_dfu_finish_flashing(DFU_STATUS_OK);
+	}
+}
+// the blocks are all programmed, the erases, write-backs and readbacks they
+// left behind are done, all from the main loop with USB being serviced
+static void flush_done(struct vkart_job* j, enum vkart_job_result res) {
+	(void)j;
+	(void)res;
+	state.manifest_held = false;
+	start_manifest();
+}
+// queue up one downloaded block. it's acked right away if the
+// other buffer is free, otherwise download_done() does that later
+static void do_download(uint8_t const* data, uint16_t len) {
+	if (state.dl_status != DFU_STATUS_OK) { // an earlier block failed
+		uint8_t status = state.dl_status;
+		deinit_download();
+		tud_dfu_finish_flashing(status);
+		return;
+	}
+	if (state.stop) {
+		/*iprintf("[DFU] STOP!\r\n");*/
+		tud_dfu_finish_flashing(DFU_STATUS_OK);
+		return;
+	}
+
+	// never busy, we don't ack a block while both buffers are in use
+	struct dl_buf* buf = &dl_bufs[state.dl_next];
+	memcpy(buf->data, data, len);
+	buf->offset = state.offset;
+	buf->job.type = VKART_JOB_PROGRAM;
+	buf->job.src = (const uint16_t*)buf->data;
+	buf->job.len = len >> 1;
+	buf->job.done = download_done;
+	if (!vkart_job_submit(&buf->job)) {
+		deinit_download();
+		tud_dfu_finish_flashing(DFU_STATUS_ERR_UNKNOWN);
+		return;
+	}
+	buf->busy = true;
+	state.offset += len;
+	state.dl_next ^= 1;
+
+	if (dl_bufs[state.dl_next].busy) state.ack_held = true;
+	else tud_dfu_finish_flashing(DFU_STATUS_OK);
 }
 
+// every sector got read back and checked against what was written to it,
+// the flush job saw to it, all that's left is to tell the host how it went
+static void start_manifest(void) {
+	bool verify_good = vkart_wrimage_finish();
+
+	if (!verify_good) {
+		uint32_t n;
+		vkart_wrimage_bad_sectors(&n);
+		iprintf("[DFU] manifest: %lu bad sectors, first at %08lx, %lu to resend\r\n",
+				vkart_stats.sectors_bad, vkart_stats.first_bad_addr << 1, n);
+	}
+	deinit_download();
+
+	tud_dfu_finish_flashing(verify_good ? DFU_STATUS_OK : DFU_STATUS_ERR_VERIFY);
+}
 
 //--------------------------------------------------------------------+
 // DFU callbacks
@@ -100,14 +280,25 @@ static void deinit_download(void) {
 // Invoked right before tud_dfu_download_cb() (state=DFU_DNBUSY) or tud_dfu_manifest_cb() (state=DFU_MANIFEST)
 // Application return timeout in milliseconds (bwPollTimeout) for the next download/manifest operation.
 // During this period, USB host won't try to communicate with us.
-uint32_t tud_dfu_get_timeout_cb(uint8_t alt, uint8_t state) {
-	const uint32_t timeout_busy = 20;
+uint32_t tud_dfu_get_timeout_cb(uint8_t alt, uint8_t dstate) {
+	const struct vkart_geometry* g = vkart_get_geometry();
+	const uint32_t xfer_words = CFG_TUD_DFU_XFER_BUFSIZE / sizeof(uint16_t);
 	const uint32_t timeout_manifest = 300;
-
-	//iprintf(" [DFU] get timeout alt=%u state=%u\r\n", alt, state);
-	if (state == DFU_DNBUSY) {
-		return timeout_busy;
-	} else if (state == DFU_MANIFEST) {
+	const uint32_t timeout_erase = g->sector_erase_ms ? g->sector_erase_ms : 1000;
+
+	// typical time to program one transfer, that's how long a held back
+	// ack usually waits for a buffer
+	uint32_t timeout_busy = (g->wbuf_words && g->buf_prog_us)
+		? xfer_words / g->wbuf_words * g->buf_prog_us
+		: xfer_words * g->word_prog_us;
+	timeout_busy = timeout_busy / 1000 + 1;
+
+	//iprintf(" [DFU] get timeout alt=%u state=%u\r\n", alt, dstate);
+	if (dstate == DFU_DNBUSY) {
+		if (state.erasing) return timeout_erase;
+		// a free buffer means the block gets acked right away
+		return dl_bufs[state.dl_next ^ 1].busy ? timeout_busy : 1;
+	} else if (dstate == DFU_MANIFEST) {
 		return timeout_busy + timeout_manifest; // may need final data flush here
 	}
 
@@ -118,8 +309,6 @@ uint32_t tud_dfu_get_timeout_cb(uint8_t alt, uint8_t state) {
 // This callback could be returned before flashing op is complete (async).
 // Once finished flashing, application must call tud_dfu_finish_flashing()
 void tud_dfu_download_cb(uint8_t alt, uint16_t block_num, uint8_t const* data, uint16_t len) {
-	(void)alt;
-
 	//iprintf("[DFU] download alt=%u block=%u length=%u\r\n", alt, block_num, len);
 
 	if (len & 1) { // no unaligned writes, sorry
@@ -128,7 +317,7 @@ void tud_dfu_download_cb(uint8_t alt, uint16_t block_num, uint8_t const* data, u
 	}
 	if (state.curact != act_download) {
 		if (block_num == 0) { // first block? time to init stuff then
-			if (!init_download()) return;
+			if (!init_download(alt)) return;
 		} else {
 			tud_dfu_finish_flashing(DFU_STATUS_ERR_UNKNOWN);
 			return;
@@ -138,27 +327,14 @@ void tud_dfu_download_cb(uint8_t alt, uint16_t block_num, uint8_t const* data, u
 	if (state.offset + len >= state.maxlen) {
 		// too much, truncate
 		int64_t llen = state.maxlen - state.offset;
-		if (llen < 0 || len > UINT16_MAX) {
+		if (llen < 0 || llen > UINT16_MAX) {
 			tud_dfu_finish_flashing(DFU_STATUS_ERR_ADDRESS);
 			return;
 		}
-		len = (uint16_t)len;
-	}
-
-	if (!state.stop) {
-		state.crcacc = crc32(state.crcacc, data, len);
-		//iprintf("[DFU] CRC at %08lx is: %08lx\r\n", state.offset, state.crcacc);
-		state.stop = vkart_wrimage_next((const uint16_t*)data, len >> 1);
-		state.offset += len;
-		//iprintf("[DFU] write done\r\n");
+		len = (uint16_t)llen;
 	}
-	/*if (state.stop) {
-		iprintf("[DFU] STOP!\r\n");
-	}*/
 
-	// flashing op for download complete without error
-	tud_dfu_finish_flashing(DFU_STATUS_OK);
-	return;
+	do_download(data, len);
 }
 
 // Invoked when download process is complete, received DFU_DNLOAD (wLength=0) following by DFU_GETSTATUS (state=Manifest)
@@ -173,33 +349,22 @@ void tud_dfu_manifest_cb(uint8_t alt) {
 		return;
 	}
 
-	vkart_wrimage_finish();
-
-	uint32_t check_acc = CRC32_INITIAL;
-	uint32_t total_len_b = state.offset;
-
-	for (uint32_t block = 0, todo = 4096/*VKART_BUFFER_WORDSZ*sizeof(uint16_t)*/;
-			block < total_len_b;
-			block += todo) {
-		if (block + todo > total_len_b) todo = total_len_b - block;
-
-		vkart_read_data(block >> 1, vkart_data_buffer, todo >> 1);
-		check_acc = crc32(check_acc, vkart_data_buffer, todo);
-		//iprintf("[DFU] check CRC at %08lx is: %08lx\r\n", block, check_acc);
+	if (state.dl_status != DFU_STATUS_OK) {
+		uint8_t status = state.dl_status;
+		deinit_download();
+		tud_dfu_finish_flashing(status);
+		return;
 	}
 
-	iprintf("[DFU] CRC manifest check: %08lx (write) vs %08lx (check)\r\n", state.crcacc, check_acc);
-	bool verify_good = check_acc == state.crcacc;
-
-	deinit_download();
-
-	if (verify_good) {
-		// flashing op for manifest is complete without error
-		// Application can perform checksum, should it fail, use appropriate status such as errVERIFY.
-		tud_dfu_finish_flashing(DFU_STATUS_OK);
-	} else {
-		tud_dfu_finish_flashing(DFU_STATUS_ERR_VERIFY);
+	// behind whatever blocks are still queued, flush_done() takes it from there
+	flush_job.type = VKART_JOB_FLUSH;
+	flush_job.done = flush_done;
+	if (!vkart_job_submit(&flush_job)) {
+		deinit_download();
+		tud_dfu_finish_flashing(DFU_STATUS_ERR_UNKNOWN);
+		return;
 	}
+	state.manifest_held = true;
 }
 
 // Invoked when received DFU_UPLOAD request
@@ -227,10 +392,19 @@ uint16_t tud_dfu_upload_cb(uint8_t alt, uint16_t block_num, uint8_t* data, uint1
 		need_exit = true;
 	}
 
-	vkart_read_data(state.offset >> 1, (uint16_t*)data, len_todo >> 1);
+	// the read ahead usually has it already, or is on it
+	struct dl_buf* ahead = &dl_bufs[0];
+	while (ahead->busy) vkart_job_task();
+	if (state.read_ahead && ahead->offset == state.offset && (ahead->job.len << 1) >= len_todo) {
+		memcpy(data, ahead->data, len_todo);
+	} else {
+		vkart_read_data(state.offset >> 1, (uint16_t*)data, len_todo >> 1);
+	}
+	state.read_ahead = false;
 	state.offset += len_todo;
 
 	if (need_exit) deinit_upload();
+	else read_ahead(len);
 
 	return len_todo;
 }
@@ -244,6 +418,43 @@ void tud_dfu_abort_cb(uint8_t alt) {
 	if (state.curact == act_download) deinit_download();
 }
 
+// Invoked for vendor control requests, which the DFU class doesn't handle
+bool tud_vendor_control_xfer_cb(uint8_t rhport, uint8_t stage, tusb_control_request_t const* request) {
+	if (stage != CONTROL_STAGE_SETUP) return true;
+	if (request->bmRequestType_bit.recipient != TUSB_REQ_RCPT_DEVICE) return false;
+
+	switch (request->bRequest) {
+	case VREQ_SET_IMAGE_LEN:
+		image_len_hint = ((uint32_t)request->wIndex << 16) | request->wValue;
+		iprintf("[DFU] host says image is %lu bytes\r\n", image_len_hint);
+		return tud_control_status(rhport, request);
+	case VREQ_SET_READ_ENGINE:
+		if (request->wValue > VKART_READ_DMA) return false;
+		vkart_set_read_engine(request->wValue);
+		return tud_control_status(rhport, request);
+	case VREQ_GET_BAD_SECTORS: {
+		uint32_t n;
+		const struct vkart_bad_sector* bad = vkart_wrimage_bad_sectors(&n);
+		for (uint32_t i = 0; i < n; ++i) {
+			bad_report[i].offset = bad[i].addr << 1;
+			bad_report[i].len = bad[i].len << 1;
+			bad_report[i].crc = bad[i].crc;
+			bad_report[i].tries = bad[i].tries;
+		}
+		uint16_t len = n * sizeof(struct bad_sector_report);
+		if (len > request->wLength) len = request->wLength;
+		return tud_control_xfer(rhport, request, bad_report, len);
+	}
+	case VREQ_REPAIR_SECTOR:
+		repair_addr = (((uint32_t)request->wIndex << 16) | request->wValue) >> 1;
+		repair_next = true;
+		iprintf("[DFU] host resends the sector at %08lx\r\n", repair_addr << 1);
+		return tud_control_status(rhport, request);
+	default:
+		return false;
+	}
+}
+
 // Invoked when a DFU_DETACH request is received
 void tud_dfu_detach_cb(void) {
 	iprintf("[DFU] detach\r\n");
@@ -3,10 +3,15 @@
 #define DFU_H_
 
 // Number of Alternate Interface (each for 1 flash partition)
-#define ALT_COUNT   1
+#define ALT_COUNT   2
+
+// same partition (the whole cart), different ways of writing it
+#define ALT_INCREMENTAL 0 /* erase only sectors that need it */
+#define ALT_CHIP_ERASE  1 /* full reflash: chip erase first, then program */
 
 #define DFU_PARTITION_NAMES \
-	"VKart NOR DFU" \
+	"VKart NOR DFU", \
+	"VKart NOR DFU (chip erase)" \
 
 
 #endif
@@ -3,6 +3,7 @@
 #include "vkart_flash.h"
 #include "debug.h"
 #include "util.h"
+#include "int_flash.h"
 
 #include <stdbool.h>
 #include <stdio.h>
@@ -16,13 +17,54 @@ static void set_address(uint32_t address);
 static void set_data(uint16_t data);
 static uint16_t get_data(void);
 static void write_word(uint32_t address, uint16_t word);
-static void write_word_mx(uint32_t addr, uint16_t d1);
-static void write_word_29w(uint32_t addr, uint16_t d1, uint16_t d2);
-static void erase_block(uint32_t addr);
-//static void erase_chip();
+static void bus_write(uint32_t addr, uint16_t word);
+static bool write_word_mx(uint32_t addr, uint16_t d1);
+static bool write_word_29w(uint32_t addr, uint16_t d1, uint16_t d2);
+static bool write_quad_29w(uint32_t addr, const uint16_t* d);
+static bool write_buffer_mx(uint32_t addr, const uint16_t* pbuf, uint32_t n);
+static void load_buffer(uint32_t addr, const uint16_t* pbuf, uint32_t n);
+static uint32_t page_chunk(uint32_t addr, uint32_t left, uint32_t page);
+static uint32_t trim_blank(const uint16_t* pbuf, uint32_t* lo, uint32_t* hi);
+static bool prog_mx(uint32_t addr, const uint16_t* pbuf, uint32_t len, uint32_t* skipped);
+static bool prog_m29w(uint32_t addr, const uint16_t* pbuf, uint32_t len, uint32_t* skipped);
+static void amd_reset(void);
+static uint32_t amd_erase(const uint32_t* addrs, uint32_t n);
+static bool amd_erase_chip(void);
+static enum poll_result amd_erase_poll(uint32_t addr);
+static bool amd_suspend(uint32_t addr);
+static void amd_resume(uint32_t addr);
+static void intel_reset(void);
+static bool intel_program(uint32_t addr, const uint16_t* pbuf, uint32_t len, uint32_t* skipped);
+static uint32_t intel_erase(const uint32_t* addrs, uint32_t n);
+static bool intel_erase_chip(void);
+static enum poll_result intel_erase_poll(uint32_t addr);
+static bool intel_suspend(uint32_t addr);
+static void intel_resume(uint32_t addr);
+static void erase_issue(void);
+static bool erase_chip_start(void);
+static bool erase_hits(uint32_t addr, uint32_t len);
+static bool erase_suspend(void);
+static void erase_resume(void);
 static uint16_t read_word(uint32_t address);
+static uint16_t bus_read(uint32_t addr);
+static void read_burst(uint32_t addr, uint16_t* buff, uint32_t len);
+static bool read_is_blank(uint32_t addr, uint32_t len);
+static void read_bus(uint32_t addr, uint16_t* buff, uint32_t len);
+static void read_wait_dma(void);
+static void dma_init(void);
+static bool is_blank(const uint16_t* pbuf, uint32_t n);
 static uint16_t get_device_id(void);
+static bool read_cfi(void);
+static void calibrate_bus(void);
+static void legacy_geometry(void);
 static void do_reset(void);
+static void bypass_enter(void);
+static void bypass_leave(void);
+static bool stage_save(uint32_t addr, uint32_t len);
+static bool stage_append(const uint16_t* pbuf, uint32_t n);
+static bool stage_flush(void);
+static void start_new_sector(void);
+static void verify_step(void);
 
 /*
  * MX commands
@@ -32,8 +74,14 @@ static void do_reset(void);
  * 555,AA 2AA,55 555,88		Enter Security region enable
  * 555,AA 2AA,55 555,90 xxx,00  Exit Security sector
  * 555,AA 2AA,55 555,A0		Program
+ * 555,AA 2AA,55 sct,25 sct,N-1 PA,PD (xN) sct,29	Write to Buffer (max 32 words, one page)
+ * 555,AA 2AA,55 555,F0		Write to Buffer abort reset
+ * 555,AA 2AA,55 555,20		Unlock Bypass
+ * xxx,A0 PA,PD			Unlock Bypass Program
+ * xxx,90 xxx,00		Unlock Bypass Reset
  * 555,AA 2AA,55 555,80 555,AA 2AA,55 555,10	Chip Erase
  * 555,AA 2AA,55 555,80 555,AA 2AA,55 sct,30	Sector sct erase
+ *   (sct2,30 sct3,30 ...	more sectors, each within 50us of the previous)
  *  55,98			CFI read
  * xxx,B0 			Erase suspend
  * xxx,30			Erase resume
@@ -55,82 +103,478 @@ static void do_reset(void);
  * 000,90 000,00			Unlock ByPass Reset
  * 555,AA 2AA,55 55,555 555,80 555,AA 2AA,55 555,10	Chip Erase
  * 555,AA 2AA,55 555,80 555,AA 2AA,55 BlkA,30	Block Erase
+ *   (BlkB,30 BlkC,30 ...		more blocks, each within 50us of the previous)
  * 000,B0					Program Erase Suspend
  * 000,30					Program Erase Resume
  * 555,AA 2AA,55 555,88		Enter Extended Block
  * 555,AA 2AA,55 555,90 000,00	Exit Extended Block
+ *
+ *
+ *
+ * Intel/Sharp commands (CFI command set 0001/0003), any address in the block
+ *
+ * xxx,FF					Read Array
+ * xxx,70					Read Status Register
+ * xxx,50					Clear Status Register
+ * xxx,90					Read Identifier
+ * 55,98					CFI read
+ * PA,40 PA,PD				Word Program
+ * BA,E8 BA,N-1 PA,PD (xN) BA,D0	Buffered Program (SR7 after E8: buffer free)
+ * BA,20 BA,D0				Block Erase
+ * xxx,B0					Program/Erase Suspend
+ * xxx,D0					Program/Erase Resume
+ * BA,60 BA,D0				Clear Block Lock-Bit(s)
  */
 
 #define DATA_READ 	0
 #define DATA_WRITE  	1
 
 #define SET_MASK(A, B, mask) ( (A & ~mask) | (B & mask) )
-#define WAIT_SOME() asm volatile("nop;nop;nop;nop;nop;nop;nop;nop;nop":::"memory")
+#define ADDR_HI_MASK 0xfc00 /* A16..A21 on PB10..PB15 */
+#define DQ1 0x02
+#define DQ3 0x08
+#define DQ5 0x20
+#define DQ6 0x40
+#define SR_READY 0x80 /* Intel status register */
+#define SR_SUSPENDED 0x40
+#define SR_ERASE_ERR 0x20
+#define SR_PROG_ERR 0x10
+#define SR_VPP_ERR 0x08
+#define SR_LOCKED 0x02
+#define SR_ERRORS (SR_ERASE_ERR | SR_PROG_ERR | SR_VPP_ERR | SR_LOCKED)
+// timeouts are twice the CFI max times, these are for when it doesn't say
+#define PROG_TIMEOUT_US 1000 /* single/double/quad program, datasheet max is a few 100 us */
+#define BUF_TIMEOUT_US 2000 /* write buffer program, datasheet max is < 1 ms per page */
+#define ERASE_TIMEOUT_US 5000000 /* sector erase, datasheet max is 3.5..4 s */
+#define CHIP_ERASE_TIMEOUT_US 200000000 /* datasheet max is ~2 min for 8 MB */
+#define TIMEOUT_MAX_US 3600000000u /* what erase.elapsed_us can count up to, with room */
+#define ERASE_FOLD_TICKS 0x40000000u /* erase.t0 moves up well before the tick counter wraps */
+#define ERASE_BATCH_MAX 8 /* sectors per multi-sector erase command */
+#define SUSPEND_TIMEOUT_US 50 /* erase suspend latency, datasheet max is 20..30 us */
+#define SUSPEND_GAP_US 500 /* erase time between a resume and the next suspend */
+#define MAX_SECTORS 1024 /* erased_ahead bitmap size, the rest of the chip goes unused */
+#define MAX_REGIONS 4 /* erase regions, CFI allows more but no NOR part has them */
+#define NO_BLOCK 0xffff
+#define STAGE_PAGE_WORDS (INT_FLASH_PAGE_SIZE / sizeof(uint16_t))
+#define RESTORE_SLICE_WORDS 256 /* written back from the stage per vkart_wrimage_next() */
+#define SLICE_WORDS 256 /* compared or read back at a time, also per vkart_wrimage_next() */
+#define VERIFY_QUEUE_LEN 4 /* finished sectors waiting for their readback */
+#define REPAIR_TRIES 2 /* rewrites of a sector that doesn't read back right */
+#define BUS_LOOP_CYCLES 3 /* one bus_delay() iteration: nop, decrement, branch */
+#define BUS_MARGIN_CYCLES 2 /* added on top of +25% to what calibration found */
+#define CAL_WORDS 64 /* calibration window */
+#define CAL_ROUNDS 16 /* reads of the window that all have to agree */
+#define DMA_CHUNK_WORDS 1024 /* address table size, the most one DMA run reads */
+#define DMA_UP_LATENCY_CYCLES 8 /* timer update to the address being on the pins */
+#define DMA_SLACK_CYCLES 8 /* sample to the next address, lets the capture finish */
+#define READ_SLICE_WORDS 256 /* per vkart_read_poll() when the CPU does the reading */
+#define VERIFY_PIECE_WORDS 64 /* read back while the one before gets its CRC */
+#ifndef VKART_IRQ_CHUNK_WORDS
+#define VKART_IRQ_CHUNK_WORDS 64 /* most words a burst moves with IRQs masked */
+#endif
 
-enum layout_type_t {
-	REGULAR = 0,
-	BOTTOM,
-	TOP
+// CRITICAL_SECTION that keeps track of the longest one, see irq_off_max
+#define BUS_LOCKED(...) CRITICAL_SECTION({ \
+		uint32_t __t0 = Delay_GetTicks(); \
+		do { __VA_ARGS__; } while (0); \
+		uint32_t __dt = Delay_GetTicks() - __t0; \
+		if (__dt > irq_off_max) irq_off_max = __dt; \
+	})
+
+// bus delays in CPU cycles, see bus_delay(). starts out at what the nine
+// nops everything used to wait were, calibrate_bus() shortens them to
+// what the cart in the slot actually needs.
+struct bus_timing {
+	uint8_t addr_setup;   // address and RW stable before CE goes low on a read
+	uint8_t read_access;  // CE low to data valid
+	uint8_t burst_access; // address change to data valid with CE held low
+	uint8_t page_access;  // same within an open page (tPACC)
+	uint8_t write_setup;  // same on a write, only shortened where writes can be checked
+	uint8_t write_pulse;  // CE low to data, and data to CE high on a write
+};
+static const struct bus_timing bus_safe = {
+	.addr_setup = 9,
+	.read_access = 9,
+	.burst_access = 18,
+	.page_access = 18,
+	.write_setup = 9,
+	.write_pulse = 9,
 };
+static struct bus_timing bus = bus_safe;
 
 static struct {
 	uint16_t device_id;
-	uint8_t flash_layout; // layout_type_t
-	int8_t top_bottom;
-	bool support_double;
+	uint16_t cmdset; // CFI primary command set, 0 if there's no CFI
+	uint8_t multi_words; // 2 for Double Program, 4 for Quadruple too, 0 if neither
+	uint16_t wbuf_words; // write buffer size in words, 0 if not supported
+	uint8_t page_words; // page mode read page size, 0 if not supported
+	uint32_t prog_timeout_us;
+	uint32_t buf_timeout_us;
+	uint32_t erase_timeout_us; // per sector
+	uint32_t chip_timeout_us;
 } meta = {
-	.flash_layout = REGULAR,
-	.top_bottom = -1,
-	.support_double = false,
+	.multi_words = 0,
+	.wbuf_words = 0,
+	.prog_timeout_us = PROG_TIMEOUT_US,
+	.buf_timeout_us = BUF_TIMEOUT_US,
+	.erase_timeout_us = ERASE_TIMEOUT_US,
+	.chip_timeout_us = CHIP_ERASE_TIMEOUT_US,
+};
+static struct vkart_geometry geometry;
+
+// erase regions in address order, sectors are a power of two in size and
+// aligned to it, so finding one is a shift once the region is known
+static struct region {
+	uint32_t start;
+	uint32_t end;
+	uint16_t first_block;
+	uint8_t shift; // log2 of the sector size in words
+} regions[MAX_REGIONS];
+static uint8_t num_regions;
+
+enum poll_result {
+	POLL_OK = 0,
+	POLL_BUSY,     // still going (poll_once() only)
+	POLL_TIMEOUT,  // DQ5 (or an Intel error bit) set, or the chip never finished
+	POLL_ABORT,    // DQ1 set, write buffer program aborted
+};
+
+// everything that depends on the command set, picked at init. erases only get
+// started here, the caller polls and suspends through the same driver.
+struct chip_driver {
+	const char* name;
+	void (*reset)(void); // back to array reads
+	// program len words, 0xffff words may be left out (counted in *skipped)
+	bool (*program)(uint32_t addr, const uint16_t* pbuf, uint32_t len, uint32_t* skipped);
+	uint32_t (*erase)(const uint32_t* addrs, uint32_t n); // returns how many it took
+	bool (*erase_chip)(void); // false if there's no such command
+	enum poll_result (*erase_poll)(uint32_t addr); // single look, addr is in the erasing sector
+	bool (*suspend)(uint32_t addr); // hold the erase, for array reads elsewhere
+	void (*resume)(uint32_t addr);
 };
+static const struct chip_driver drv_mx29gl, drv_m29w, drv_intel;
+static const struct chip_driver* drv = &drv_mx29gl;
+
+// set while the chip sits in unlock bypass mode. only (bypass) program and
+// array reads are valid in there, everything else has to bypass_leave() first.
+static bool unlock_bypass = false;
 
 enum sector_action_type {
 	ERASE_REWRITE_FULL = 1, // do a full erase & write
 	WAS_ERASED = 2,         // was already erased, only write
-	SAME_CHECK_BUSY = 3,    // check if the data we're writing is already the same
+	SAME_CHECK_BUSY = 3,    // check if the data we're writing is already the same,
+	                        // or can be programmed over what's there without an erase
 };
 
 uint16_t vkart_data_buffer[VKART_BUFFER_WORDSZ];
+
+static enum vkart_read_engine read_engine = VKART_READ_CPU;
+
+// longest BUS_LOCKED stretch in SysTicks since the last wrimage start
+static uint32_t irq_off_max;
+
+// scratch for the loops that read the cart a slice at a time to compare or
+// checksum it. none of them runs inside another, and the stack is only 2 KB.
+static uint16_t slice[SLICE_WORDS];
+
+// TIM1 paces the DMA read engine: on each update DMA1 channel 5 puts the next
+// address from dma_addrs on GPIOC, on each CC1 channel 2 captures GPIOD.
+// the first address is set by the CPU, so dma_addrs[i] is word i+1's.
+static uint16_t dma_addrs[DMA_CHUNK_WORDS];
+
+// background read, see vkart_read_start()
+static struct {
+	uint32_t addr;
+	uint16_t* dst;
+	uint32_t len;
+	uint32_t off;
+	uint32_t n; // words in the DMA run in flight, 0 if none
+} rd;
+struct vkart_stats vkart_stats;
+// the erase running in the background, one at a time. see vkart_erase_start()
+static struct {
+	uint32_t addrs[ERASE_BATCH_MAX];
+	uint32_t n;       // sectors in addrs
+	uint32_t next;    // first one not handed to the chip yet
+	uint32_t k;       // sectors in the running command
+	uint32_t t0;
+	uint32_t elapsed_us; // before t0, the tick counter wraps after ~4 minutes
+	uint32_t t_suspend;
+	uint32_t t_resume; // so back-to-back suspends don't starve the erase
+	uint32_t time_us; // all commands so far
+	bool busy;
+	bool chip;
+	bool failed; // sticks until the next erase, a waiting reader may see it first
+} erase;
 #define wrimage_buf vkart_data_buffer
 static struct {
 	uint32_t blockaddr;
 	uint32_t off_in_block;
-	uint16_t blocklen;
-	uint8_t block;
+	uint32_t known_end; // how far we know the image goes, for erase lookahead. without
+	                    // a length hint that's only the end of the data handed over so far
+	uint32_t erased_ahead[(MAX_SECTORS + 31) / 32]; // by block number
+	uint32_t blocklen;
+	uint16_t block;
 	uint8_t act_typ; // sector_action_type
 	bool new_sector;
+	bool chip_erased; // whole chip was erased at start, skip all sector checks
+	bool chip_erasing;
+	bool erase_all; // chip erase asked for but not there: erase by sector, no checks
+	bool restore; // same check failed (or a small sector read back wrong): sector is erasing,
+	              // its data collects in the stage or wrimage_buf
+	uint32_t restored; // words of it written back after the erase
+	uint32_t crc; // of the data taken for this sector so far
+	uint8_t rewrites; // of a small sector after a bad readback
+	bool tail_queued; // vkart_wrimage_drain() has the last sector's readback going
 } wrimage = {
-	.block = 0xff,
+	.block = NO_BLOCK,
 	.act_typ = 0,
 	.new_sector = false
 };
+// finished sectors are read back a slice at a time alongside the writing of
+// the next ones, and checked against the CRC of what they were handed
+static struct verify_entry {
+	uint32_t addr;
+	uint32_t len; // words written, less than the sector at the end of the image
+	uint32_t crc; // expected
+	uint16_t block;
+} verify_queue[VERIFY_QUEUE_LEN];
+static struct {
+	uint8_t head, count;
+	uint32_t off; // into the head entry
+	uint32_t acc;
+} verify;
+// sectors of the image that didn't read back right and couldn't be rewritten
+// from wrimage_buf, kept until the host resends them, see vkart_wrimage_repair()
+static struct vkart_bad_sector bad[VKART_BAD_SECTORS_MAX];
+static uint32_t num_bad;
+static bool bad_lost; // more than fit in bad[], only a full rewrite helps
+static bool repairing; // the session rewrites only the bad sector at repair_addr
+static uint32_t repair_addr;
 
 
 struct len_and_block {
-	uint16_t len;
+	uint32_t len;
 	uint16_t block;
 };
 
 static struct len_and_block info_of_address(uint32_t addr) {
-	uint16_t len, block;
-
-	len = 0x8000;
-	block = addr >> 15;
-	if (meta.flash_layout == BOTTOM) {
-		if (block == meta.top_bottom) {
-			block = addr >> 12;
-			len = 0x1000;
-		} else {
-			block += 7;
+	const struct region* r = regions;
+	while (r < &regions[num_regions - 1] && addr >= r->end) ++r;
+
+	return (struct len_and_block){
+		.len = (uint32_t)1 << r->shift,
+		.block = r->first_block + ((addr - r->start) >> r->shift),
+	};
+}
+// appends count sectors of 1<<shift words, clipped to what we can address
+static void add_region(uint32_t count, uint8_t shift) {
+	uint32_t start = num_regions ? regions[num_regions - 1].end : 0;
+	uint16_t first = num_regions ? geometry.sectors : 0;
+
+	if (num_regions == MAX_REGIONS || start >= VKART_MEMORY_WORDSZ) return;
+	if (count > ((VKART_MEMORY_WORDSZ - start) >> shift)) count = (VKART_MEMORY_WORDSZ - start) >> shift;
+	if (first + count > MAX_SECTORS) count = MAX_SECTORS - first;
+	if (!count) return;
+
+	regions[num_regions++] = (struct region){
+		.start = start,
+		.end = start + (count << shift),
+		.first_block = first,
+		.shift = shift,
+	};
+	geometry.sectors = first + count;
+	geometry.words = start + (count << shift);
+}
+static uint8_t cfi_byte(uint32_t off) {
+	return read_word(off) & 0xff;
+}
+// CFI max times can be far longer than the tick counter lasts, or overflow
+static uint32_t clamp_timeout(uint64_t us) {
+	return (us > TIMEOUT_MAX_US) ? TIMEOUT_MAX_US : (uint32_t)us;
+}
+static uint8_t log2_words(uint32_t words) {
+	uint8_t shift = 0;
+	while (((uint32_t)2 << shift) <= words) ++shift;
+	return shift;
+}
+// CFI query (55,98): erase regions, write buffer size and typical/max times.
+// false if the chip doesn't answer with "QRY".
+static bool read_cfi(void) {
+	uint8_t t[8], nreg, wbuf_log2, boot = 0;
+	uint32_t reg[MAX_REGIONS][2]; // sector count, sector size in words
+
+	do_reset();
+	write_word(0x55, 0x98);
+	set_data_dir(DATA_READ);
+	if (cfi_byte(0x10) != 'Q' || cfi_byte(0x11) != 'R' || cfi_byte(0x12) != 'Y') {
+		do_reset();
+		return false;
+	}
+
+	uint16_t cmdset = meta.cmdset = cfi_byte(0x13) | (cfi_byte(0x14) << 8);
+	uint16_t ext = cfi_byte(0x15) | (cfi_byte(0x16) << 8);
+	for (uint32_t i = 0; i < 8; ++i) t[i] = cfi_byte(0x1f + i);
+	wbuf_log2 = cfi_byte(0x2a); // in bytes
+	nreg = cfi_byte(0x2c);
+	if (nreg > MAX_REGIONS) nreg = MAX_REGIONS;
+	for (uint32_t i = 0; i < nreg; ++i) {
+		uint32_t b = 0x2d + 4*i;
+		reg[i][0] = (cfi_byte(b) | (cfi_byte(b+1) << 8)) + 1;
+		reg[i][1] = (cfi_byte(b+2) | (cfi_byte(b+3) << 8)) * 128; // 256 byte units
+		if (!reg[i][1]) reg[i][1] = 64;
+	}
+	// AMD extended table 1.1+ says where the boot sectors are and how big
+	// a read page is (1: 4 words, 2: 8, 3: 16)
+	meta.page_words = 0;
+	if (cmdset == 0x0002 && ext && cfi_byte(ext) == 'P' && cfi_byte(ext+1) == 'R'
+			&& cfi_byte(ext+2) == 'I' && cfi_byte(ext+4) >= '1') {
+		boot = cfi_byte(ext + 0xf);
+		uint8_t page = cfi_byte(ext + 0xc);
+		if (page >= 1 && page <= 3) meta.page_words = 2u << page;
+	}
+	do_reset();
+
+	// top boot parts list their regions bottom boot style, smallest first
+	for (uint32_t i = 0; i < nreg; ++i) {
+		uint32_t j = (boot == 3) ? nreg - 1 - i : i;
+		add_region(reg[j][0], log2_words(reg[j][1]));
+	}
+	if (!num_regions) return false;
+
+	if (t[0]) {
+		geometry.word_prog_us = 1u << t[0];
+		meta.prog_timeout_us = clamp_timeout(2 * ((uint64_t)geometry.word_prog_us << t[4]));
+	}
+	if (t[1]) {
+		geometry.buf_prog_us = 1u << t[1];
+		meta.buf_timeout_us = clamp_timeout(2 * ((uint64_t)geometry.buf_prog_us << t[5]));
+		if (wbuf_log2 > 1) geometry.wbuf_words = (1u << wbuf_log2) / 2;
+	}
+	if (t[2]) {
+		geometry.sector_erase_ms = 1u << t[2];
+		meta.erase_timeout_us = clamp_timeout(2000 * ((uint64_t)geometry.sector_erase_ms << t[6]));
+	}
+	if (t[3]) {
+		geometry.chip_erase_ms = 1u << t[3];
+		meta.chip_timeout_us = clamp_timeout(2000 * ((uint64_t)geometry.chip_erase_ms << t[7]));
+	}
+
+	return true;
+}
+// what we did before CFI: one boot block of 8 small sectors at the bottom or
+// top, depending on the device id
+static void legacy_geometry(void) {
+	bool bottom = meta.device_id == 0x22cb || meta.device_id == 0x22fd;
+	bool top = meta.device_id == 0x22e9 || meta.device_id == 0x22ed;
+
+	if (bottom) add_region(8, 12);
+	add_region((VKART_MEMORY_WORDSZ >> 15) - (bottom || top), 15);
+	if (top) add_region(8, 12);
+
+	geometry.word_prog_us = 10;
+	geometry.buf_prog_us = (meta.device_id == 0x22cb || meta.device_id == 0x22e9) ? 128 : 0;
+	geometry.wbuf_words = geometry.buf_prog_us ? 32 : 0;
+	geometry.sector_erase_ms = 500;
+	geometry.chip_erase_ms = 40000;
+}
+
+// -- bus timing calibration
+
+static uint16_t cal_ref[CAL_WORDS];
+static uint32_t cal_base;
+
+static bool cal_reads_agree(void) {
+	uint16_t buf[CAL_WORDS];
+
+	for (uint32_t r = 0; r < CAL_ROUNDS; ++r) {
+		read_burst(cal_base, buf, CAL_WORDS);
+		if (memcmp(buf, cal_ref, sizeof buf)) return false;
+		// backwards, so each word follows a different one than in the burst
+		for (uint32_t i = CAL_WORDS; i--; ) {
+			if (read_word(cal_base + i) != cal_ref[i]) return false;
 		}
-	} else if (meta.flash_layout == TOP) {
-		if (block == meta.top_bottom) {
-			block += (addr >> 12) & 7;
-			len = 0x1000;
+	}
+
+	return true;
+}
+// only the query command goes out at the timing under test, the reads and
+// the reset use the known good ones. a reset that didn't take would leave
+// query mode on and the next round pass no matter what.
+static bool cal_writes_agree(void) {
+	struct bus_timing trial = bus;
+	bool ok = true;
+
+	for (uint32_t r = 0; ok && r < CAL_ROUNDS; ++r) {
+		bus = trial;
+		write_word(0x55, 0x98);
+		bus.write_setup = bus_safe.write_setup;
+		bus.write_pulse = bus_safe.write_pulse;
+		set_data_dir(DATA_READ);
+		ok = cfi_byte(0x10) == 'Q' && cfi_byte(0x11) == 'R' && cfi_byte(0x12) == 'Y';
+		do_reset();
+	}
+	bus = trial;
+
+	return ok;
+}
+// walks *delay down until agree() fails, then backs off from the last one
+// that worked by 25% plus BUS_MARGIN_CYCLES, never past the safe value
+static void cal_shorten(uint8_t* delay, bool (*agree)(void)) {
+	uint8_t safe = *delay, good = safe;
+
+	while (*delay) {
+		--*delay;
+		if (!agree()) break;
+		good = *delay;
+	}
+
+	uint32_t v = good + good / 4 + BUS_MARGIN_CYCLES;
+	*delay = (v < safe) ? v : safe;
+}
+// reads need a window that isn't all one value, the start of the cart usually
+// has code in it. blank carts fall back to the CFI table. writes can only be
+// checked with the query command on AMD style parts, a mangled command on an
+// Intel part could be a program setup, so those keep the safe write setup and
+// pulse. the read setup is calibrated on its own and never used for writes.
+static void calibrate_bus(void) {
+	bus = bus_safe;
+
+	do_reset();
+	cal_base = 0;
+	read_burst(cal_base, cal_ref, CAL_WORDS);
+	if (!memcmp(cal_ref, cal_ref + 1, sizeof cal_ref - sizeof cal_ref[0])) {
+		if (!meta.cmdset) {
+			iprintf("[vkart] nothing to calibrate against, keeping safe bus timing\r\n");
+			return;
 		}
+		write_word(0x55, 0x98); // stays on until the reset after the reads
+		cal_base = 0x10;
+		read_burst(cal_base, cal_ref, CAL_WORDS);
+	}
+
+	cal_shorten(&bus.read_access, cal_reads_agree);
+	cal_shorten(&bus.addr_setup, cal_reads_agree);
+	cal_shorten(&bus.burst_access, cal_reads_agree);
+	if (meta.page_words) {
+		bus.page_access = bus.burst_access; // never slower than a random access
+		cal_shorten(&bus.page_access, cal_reads_agree);
+	}
+	do_reset();
+
+	if (meta.cmdset == 0x0002) {
+		cal_shorten(&bus.write_pulse, cal_writes_agree);
+		cal_shorten(&bus.write_setup, cal_writes_agree);
 	}
+	do_reset();
+
+	iprintf("[vkart] bus timing (cycles): setup %d, access %d, burst %d, page %d, write setup %d, write %d\r\n",
+			bus.addr_setup, bus.read_access, bus.burst_access, bus.page_access,
+			bus.write_setup, bus.write_pulse);
+}
 
-	return (struct len_and_block){.len=len, .block=block};
+const struct vkart_geometry* vkart_get_geometry(void) {
+	return &geometry;
 }
 
 bool vkart_init(void) {
@@ -162,29 +606,36 @@ bool vkart_init(void) {
 	if (devid == 0x0000) return false;
 
 	meta.device_id = devid;
-	if (devid == 0x22cb || devid == 0x22e9) { // Macronix
-		if (devid == 0x22cb) {
-			meta.flash_layout = BOTTOM;
-			meta.top_bottom = 0;
-		}
-		if (devid == 0x22e9) {
-			meta.flash_layout = TOP;
-			meta.top_bottom = 127;
-		}
+	num_regions = 0;
+	memset(&geometry, 0, sizeof geometry);
+	if (!read_cfi()) {
+		iprintf("[vkart] no CFI, going by the device id\r\n");
+		legacy_geometry();
 	}
-	if (devid == 0x22ed || devid == 0x22fd) { // ST-Numonix
-		if (devid == 0x22fd) {
-			meta.flash_layout = BOTTOM;
-			meta.top_bottom = 0;
-		}
-		if (devid == 0x22ed) {
-			meta.flash_layout = TOP;
-			meta.top_bottom = 127;
-		}
-		meta.support_double = 1;
+	if (meta.cmdset == 0x0001 || meta.cmdset == 0x0003) {
+		drv = &drv_intel;
+		meta.wbuf_words = geometry.wbuf_words;
+	} else if (devid == 0x22ed || devid == 0x22fd) {
+		// ST-Numonix: Quadruple Program beats their write buffer
+		drv = &drv_m29w;
+		meta.multi_words = 4;
+	} else {
+		drv = &drv_mx29gl;
+		meta.wbuf_words = geometry.wbuf_words;
 	}
+	iprintf("[vkart] driver: %s\r\n", drv->name);
+	calibrate_bus();
+	dma_init();
 
-	iprintf("[vkart] flash layout : %d.%d\r\n", meta.flash_layout, meta.top_bottom);
+	for (uint32_t i = 0; i < num_regions; ++i) {
+		iprintf("[vkart] region %lu: %08lx..%08lx, %lu words per sector\r\n",
+				i, regions[i].start, regions[i].end, (uint32_t)1 << regions[i].shift);
+	}
+	iprintf("[vkart] %lu words in %d sectors, write buffer %d words, read page %d words\r\n",
+			geometry.words, geometry.sectors, meta.wbuf_words, meta.page_words);
+	iprintf("[vkart] typ. program %lu us, buffer %lu us, erase %lu ms, chip erase %lu ms\r\n",
+			geometry.word_prog_us, geometry.buf_prog_us, geometry.sector_erase_ms,
+			geometry.chip_erase_ms);
 
 	do_reset();
 	Delay_Ms(10);
@@ -223,7 +674,7 @@ static void set_address(uint32_t addr) {
 	GPIOB->CFGHR = SET_MASK(GPIOB->CFGHR, 0x33333300, 0xffffff00);
 	GPIO_Write(GPIOC, addr);
 	// 1111110000000000
-	int mask = 0xfc00;
+	int mask = ADDR_HI_MASK;
 	//GPIOB->OUTDR ^= ((addr >> 16) << 10) ^ 0xfc00;
 	//GPIOB->OUTDR = (GPIOB->OUTDR & ~mask) | (((addr>>16)<<10) & mask);
 	GPIOB->OUTDR = SET_MASK(GPIOB->OUTDR, (addr >> 16) << 10, mask);
@@ -235,33 +686,194 @@ inline static void set_data(uint16_t data) {
 inline static uint16_t get_data(void) {
 	return GPIO_ReadInputData(GPIOD);
 }
+// at least the given number of cycles, give or take the loop granularity
+inline static void bus_delay(uint8_t cycles) {
+	for (uint32_t n = (cycles + BUS_LOOP_CYCLES - 1) / BUS_LOOP_CYCLES; n; --n) {
+		asm volatile("nop":::"memory");
+	}
+}
+// bus_read()/bus_write() are single cycles with IRQs left alone, for
+// sequences that lock the bus once around all of their words
+static uint16_t bus_read(uint32_t addr) {
+	set_ce(1);
+	set_rw(1);
+	set_address(addr);
+	bus_delay(bus.addr_setup);
+	set_ce(0);
+	bus_delay(bus.read_access);
+	return get_data();
+}
 static uint16_t read_word(uint32_t addr) {
 	uint16_t ret;
-	CRITICAL_SECTION({
-		set_ce(1);
-		set_rw(1);
-		set_address(addr);
-		WAIT_SOME();
-		set_ce(0);
-		WAIT_SOME();
-		ret = get_data();
+	BUS_LOCKED({
+		ret = bus_read(addr);
 	});
 	//iprintf("[vkart] read %04x\r\n", ret);
 	return ret;
 }
+// sequential read: pins are configured once, CE stays low for the whole run
+// and only the address lines that change get rewritten (the high lines on
+// GPIOB only every 64 KiW). address-to-data time is bus.burst_access, or
+// the shorter bus.page_access for the rest of an aligned page on parts with
+// page mode. IRQs get a look in every VKART_IRQ_CHUNK_WORDS, CE stays low
+// in between, nothing in an IRQ handler touches the cart.
+static void read_burst(uint32_t addr, uint16_t* buff, uint32_t len) {
+	uint32_t page_mask = meta.page_words ? meta.page_words - 1 : 0;
+
+	if (!len) return;
+
+	set_data_dir(DATA_READ);
+	set_ce(1);
+	set_rw(1);
+	set_address(addr);
+	bus_delay(bus.addr_setup);
+	set_ce(0);
+	for (uint32_t done = 0, n; done < len; done += n) {
+		n = (len - done > VKART_IRQ_CHUNK_WORDS) ? VKART_IRQ_CHUNK_WORDS : len - done;
+		BUS_LOCKED({
+			for (uint32_t i = done; i < done + n; ++i, ++addr) {
+				if (!(addr & 0xffff)) {
+					GPIOB->OUTDR = SET_MASK(GPIOB->OUTDR, (addr >> 16) << 10, ADDR_HI_MASK);
+				}
+				GPIOC->OUTDR = (uint16_t)addr;
+				bus_delay((i && (addr & page_mask)) ? bus.page_access : bus.burst_access);
+				buff[i] = (uint16_t)GPIOD->INDR;
+			}
+		});
+	}
+	set_ce(1);
+}
+static bool read_is_blank(uint32_t addr, uint32_t len) {
+	uint16_t* chunk = slice;
+
+	for (uint32_t off = 0, todo = SLICE_WORDS; off < len; off += todo) {
+		if (off + todo > len) todo = len - off;
+
+		read_burst(addr + off, chunk, todo);
+		if (!is_blank(chunk, todo)) return false;
+	}
+
+	return true;
+}
+static void dma_init(void) {
+	TIM_TimeBaseInitTypeDef tb = {0};
+	DMA_InitTypeDef dma = {0};
+
+	RCC_AHBPeriphClockCmd(RCC_AHBPeriph_DMA1, ENABLE);
+	RCC_APB2PeriphClockCmd(RCC_APB2Periph_TIM1, ENABLE);
+
+	// counts CPU cycles, same units as the bus timing
+	tb.TIM_Prescaler = 0;
+	tb.TIM_CounterMode = TIM_CounterMode_Up;
+	tb.TIM_Period = 0xffff;
+	tb.TIM_ClockDivision = TIM_CKD_DIV1;
+	TIM_TimeBaseInit(TIM1, &tb);
+	TIM1->INTFR = 0;
+	TIM_DMACmd(TIM1, TIM_DMA_Update | TIM_DMA_CC1, ENABLE);
+
+	dma.DMA_BufferSize = 1;
+	dma.DMA_PeripheralInc = DMA_PeripheralInc_Disable;
+	dma.DMA_MemoryInc = DMA_MemoryInc_Enable;
+	dma.DMA_PeripheralDataSize = DMA_PeripheralDataSize_HalfWord;
+	dma.DMA_MemoryDataSize = DMA_MemoryDataSize_HalfWord;
+	dma.DMA_Mode = DMA_Mode_Normal;
+	dma.DMA_Priority = DMA_Priority_VeryHigh;
+	dma.DMA_M2M = DMA_M2M_Disable;
+
+	dma.DMA_PeripheralBaseAddr = (uint32_t)&GPIOC->OUTDR;
+	dma.DMA_MemoryBaseAddr = (uint32_t)dma_addrs;
+	dma.DMA_DIR = DMA_DIR_PeripheralDST;
+	DMA_Init(DMA1_Channel5, &dma);
+
+	dma.DMA_PeripheralBaseAddr = (uint32_t)&GPIOD->INDR;
+	dma.DMA_MemoryBaseAddr = (uint32_t)vkart_data_buffer;
+	dma.DMA_DIR = DMA_DIR_PeripheralSRC;
+	DMA_Init(DMA1_Channel2, &dma);
+}
+// words the next DMA run can do: what fits the address table, and not past
+// a 64 KiW boundary, the high address lines on GPIOB stay put during a run
+static uint32_t dma_chunk(uint32_t addr, uint32_t len) {
+	uint32_t n = 0x10000 - (addr & 0xffff);
+	if (n > DMA_CHUNK_WORDS) n = DMA_CHUNK_WORDS;
+	return (n < len) ? n : len;
+}
+// the sample point doesn't know about pages, every word gets burst_access
+static void dma_read_begin(uint32_t addr, uint16_t* dst, uint32_t n) {
+	uint32_t sample = DMA_UP_LATENCY_CYCLES + bus.burst_access;
+
+	for (uint32_t i = 1; i < n; ++i) dma_addrs[i - 1] = (uint16_t)(addr + i);
+
+	set_data_dir(DATA_READ);
+	set_ce(1);
+	set_rw(1);
+	set_address(addr);
+	bus_delay(bus.addr_setup);
+	set_ce(0);
+	bus_delay(bus.read_access); // CC1 comes sooner than that
+
+	TIM1->ATRLR = sample + DMA_SLACK_CYCLES - 1;
+	TIM1->CH1CVR = sample;
+	TIM1->CNT = 0;
+	TIM1->INTFR = 0;
+	DMA_ClearFlag(DMA1_FLAG_GL2 | DMA1_FLAG_GL5);
+	DMA1_Channel2->MADDR = (uint32_t)dst;
+	DMA1_Channel2->CNTR = n;
+	DMA_Cmd(DMA1_Channel2, ENABLE);
+	if (n > 1) {
+		DMA1_Channel5->MADDR = (uint32_t)dma_addrs;
+		DMA1_Channel5->CNTR = n - 1;
+		DMA_Cmd(DMA1_Channel5, ENABLE);
+	}
+	TIM_Cmd(TIM1, ENABLE);
+}
+static bool dma_read_done(void) {
+	if (DMA_GetFlagStatus(DMA1_FLAG_TC2) == RESET) return false;
+
+	TIM_Cmd(TIM1, DISABLE);
+	DMA_Cmd(DMA1_Channel2, DISABLE);
+	DMA_Cmd(DMA1_Channel5, DISABLE);
+	set_ce(1);
+
+	return true;
+}
+// the bus belongs to the DMA until the run in flight is done
+static void read_wait_dma(void) {
+	if (!rd.n) return;
+
+	while (!dma_read_done())
+		;
+	rd.off += rd.n;
+	rd.n = 0;
+}
+static void read_dma(uint32_t addr, uint16_t* buff, uint32_t len) {
+	for (uint32_t n; len; addr += n, buff += n, len -= n) {
+		n = dma_chunk(addr, len);
+		dma_read_begin(addr, buff, n);
+		while (!dma_read_done())
+			;
+	}
+}
+// array reads through whichever engine is selected
+static void read_bus(uint32_t addr, uint16_t* buff, uint32_t len) {
+	if (read_engine == VKART_READ_DMA) read_dma(addr, buff, len);
+	else read_burst(addr, buff, len);
+}
+static void bus_write(uint32_t addr, uint16_t word) {
+	set_ce(1);
+	set_rw(0);
+	bus_delay(bus.write_setup);
+	set_data_dir(DATA_WRITE);
+	set_address(addr);
+	bus_delay(bus.write_setup);
+	set_ce(0);
+	bus_delay(bus.write_pulse);
+	set_data(word);
+	bus_delay(bus.write_pulse);
+	set_ce(1);
+}
 static void write_word(uint32_t addr, uint16_t word) {
-	CRITICAL_SECTION({
-		set_ce(1);
-		set_rw(0);
-		WAIT_SOME();
-		set_data_dir(DATA_WRITE);
-		set_address(addr);
-		WAIT_SOME();
-		set_ce(0);
-		WAIT_SOME();
-		set_data(word);
-		WAIT_SOME();
-		set_ce(1);
+	BUS_LOCKED({
+		bus_write(addr, word);
 	});
 }
 /*static void write_word_mx2(uint32_t addr, uint16_t d1) {
@@ -290,57 +902,208 @@ static void write_word(uint32_t addr, uint16_t word) {
 }*/
 
 
-static void write_word_mx(uint32_t addr, uint16_t d1) {
-	uint8_t t1,t2;
-	//if (d1) iprintf("[vkart] writing %04x at %08x\r\n", d1, addr);
-//	if (d1 != 0xffff) {
-		write_word(0x0555,0xAA);
-		write_word(0x02AA,0x55);
-		write_word(0x0555,0xA0);
-		write_word(addr, d1);
-		//Delay_Us(13); // typical 11us
-		while (1) {
-			t1 = read_word(0);
-			t2 = read_word(0);
-			//iprintf("%d %d\r\n", t1, t2);
-			if ((t1 & 0x40) == (t2 & 0x40)) break;
-		}
-//	}
-	//check_status();
-}
-static void write_word_29w(uint32_t addr, uint16_t d1, uint16_t d2) {
-	write_word(0x0555,0x0050);
-	write_word(addr, d1);
-	write_word(addr+1, d2);
-	//while ((read_word(0)&0x40) != (read_word(0)&0x40));
-	Delay_Us(20); // typical 10us
-}
-static void erase_block(uint32_t addr) {
-	do_reset();
-	write_word(0x0555, 0xaa);
-	write_word(0x02aa, 0x55);
-	write_word(0x0555, 0x80);
-	write_word(0x0555, 0xaa);
-	write_word(0x02aa, 0x55);
-	write_word(addr, 0x30);
+// DQ7 data polling on the last written address. fail_bits is DQ5 (timeout),
+// plus DQ1 (abort) for buffer programs; DQ1 is undefined for anything else.
+static enum poll_result poll_data(uint32_t addr, uint16_t expect, uint16_t fail_bits, uint32_t timeout_us) {
+	uint32_t start = Delay_GetTicks();
+	uint16_t q;
 
-	/*uint8_t q = 0;
-	
 	set_data_dir(DATA_READ);
 	while (1) {
 		q = read_word(addr);
-		if ((q & 0x08) != 0) break;
+		if (((q ^ expect) & 0x80) == 0) return POLL_OK;
+		if (q & fail_bits) break;
+		if (Delay_TicksToUs(Delay_GetTicks() - start) > timeout_us) break;
+	}
+
+	// DQ7 may have flipped at the same time as DQ5/DQ1 did, so check again
+	q = read_word(addr);
+	if (((q ^ expect) & 0x80) == 0) return POLL_OK;
+	return (q & fail_bits & DQ1) ? POLL_ABORT : POLL_TIMEOUT;
+}
+// single non-blocking look at the status, for operations that take long
+// enough that we want to do other things in between
+static enum poll_result poll_once(uint32_t addr, uint16_t expect, uint16_t fail_bits) {
+	uint16_t q;
+
+	set_data_dir(DATA_READ);
+	q = read_word(addr);
+	if (((q ^ expect) & 0x80) == 0) return POLL_OK;
+	if (!(q & fail_bits)) return POLL_BUSY;
+
+	q = read_word(addr);
+	if (((q ^ expect) & 0x80) == 0) return POLL_OK;
+	return (q & fail_bits & DQ1) ? POLL_ABORT : POLL_TIMEOUT;
+}
+// wait for a (single, double or quad) program to finish, last is the final
+// word written. on failure the chip is put back into read mode.
+static bool prog_wait(uint32_t addr, uint16_t last) {
+	enum poll_result r = poll_data(addr, last, DQ5, meta.prog_timeout_us);
+	if (r == POLL_OK) return true;
+
+	iprintf("[vkart] program failed at %08lx (%04x)\r\n", addr, last);
+	do_reset();
+	return false;
+}
+static bool write_word_mx(uint32_t addr, uint16_t d1) {
+	//if (d1) iprintf("[vkart] writing %04x at %08x\r\n", d1, addr);
+	// stays in bypass mode for the following words, see bypass_leave()
+	bypass_enter();
+	BUS_LOCKED({
+		bus_write(0x0000, 0xA0);
+		bus_write(addr, d1);
+	});
+	return prog_wait(addr, d1);
+}
+// the data words of a write buffer program, for both command sets. the chips
+// have no time limit on loading the buffer, so IRQs can come in between.
+static void load_buffer(uint32_t addr, const uint16_t* pbuf, uint32_t n) {
+	for (uint32_t i = 0, k; i < n; i += k) {
+		k = (n - i > VKART_IRQ_CHUNK_WORDS) ? VKART_IRQ_CHUNK_WORDS : n - i;
+		BUS_LOCKED({
+			for (uint32_t j = i; j < i + k; ++j) bus_write(addr + j, pbuf[j]);
+		});
+	}
+}
+// words from addr up to the end of its aligned page, at most left
+static uint32_t page_chunk(uint32_t addr, uint32_t left, uint32_t page) {
+	uint32_t n = page - (addr & (page - 1));
+	return (n > left) ? left : n;
+}
+// narrows [*lo, *hi) down to its first and last non-blank word, returns how
+// many blank words that left out. only the part in between gets programmed.
+static uint32_t trim_blank(const uint16_t* pbuf, uint32_t* lo, uint32_t* hi) {
+	uint32_t n = *hi - *lo;
+	while (*lo < *hi && pbuf[*lo] == 0xffff) ++*lo;
+	while (*hi > *lo && pbuf[*hi - 1] == 0xffff) --*hi;
+	return n - (*hi - *lo);
+}
+// n words starting at addr, must not cross a write buffer page
+static bool write_buffer_mx(uint32_t addr, const uint16_t* pbuf, uint32_t n) {
+	bypass_leave();
+	BUS_LOCKED({
+		bus_write(0x0555, 0xAA);
+		bus_write(0x02AA, 0x55);
+		bus_write(addr, 0x25);
+		bus_write(addr, n - 1);
+	});
+	load_buffer(addr, pbuf, n);
+	write_word(addr, 0x29);
+
+	enum poll_result r = poll_data(addr + n - 1, pbuf[n - 1], DQ5|DQ1, meta.buf_timeout_us);
+	if (r != POLL_OK) {
+		// abort reset, also gets us out of a DQ5 timeout
+		write_word(0x0555, 0xAA);
+		write_word(0x02AA, 0x55);
+		write_word(0x0555, 0xF0);
+		iprintf("[vkart] buffer program %s at %08lx\r\n",
+				(r == POLL_ABORT) ? "aborted" : "timed out", addr);
+		return false;
 	}
-	while (1) {
-		q = read_word(addr);
 
-		if ((q & 0x80) != 0) {
-			// Finished
-			break;
+	return true;
+}
+static bool write_word_29w(uint32_t addr, uint16_t d1, uint16_t d2) {
+	bypass_leave();
+	BUS_LOCKED({
+		bus_write(0x0555, 0x0050);
+		bus_write(addr, d1);
+		bus_write(addr+1, d2);
+	});
+	return prog_wait(addr+1, d2); // typical 10us
+}
+// d[0..3] go to addr..addr+3, addr must be 4-word aligned
+static bool write_quad_29w(uint32_t addr, const uint16_t* d) {
+	bypass_leave();
+	BUS_LOCKED({
+		bus_write(0x0555, 0x0056);
+		bus_write(addr, d[0]);
+		bus_write(addr+1, d[1]);
+		bus_write(addr+2, d[2]);
+		bus_write(addr+3, d[3]);
+	});
+	return prog_wait(addr+3, d[3]); // typical 10us, same as double
+}
+// starts erasing up to n sectors with one command sequence. returns how many
+// of them were accepted, which can be less if the 50us window closed before
+// we got them all in. the last accepted one is where to poll for completion.
+static uint32_t amd_erase(const uint32_t* addrs, uint32_t n) {
+	uint32_t k;
+
+	do_reset();
+	// in one go, so an IRQ can't close the 50us window on us
+	BUS_LOCKED({
+		bus_write(0x0555, 0xaa);
+		bus_write(0x02aa, 0x55);
+		bus_write(0x0555, 0x80);
+		bus_write(0x0555, 0xaa);
+		bus_write(0x02aa, 0x55);
+		bus_write(addrs[0], 0x30);
+		for (k = 1; k < n; ++k) {
+			// DQ3 goes high when the chip stops taking more sectors
+			set_data_dir(DATA_READ);
+			if (bus_read(addrs[k-1]) & DQ3) break;
+			bus_write(addrs[k], 0x30);
 		}
-	} */
-	Delay_Ms(900);
-	//iprintf("[vkart] End erase block %08lx st=%02x\r\n", addr, q);
+	});
+
+	return k;
+}
+// hands the next batch of the running erase to the chip
+static void erase_issue(void) {
+	erase.k = drv->erase(erase.addrs + erase.next, erase.n - erase.next);
+	erase.next += erase.k;
+	erase.t0 = erase.t_resume = Delay_GetTicks();
+	erase.elapsed_us = 0;
+}
+// does [addr, addr+len) touch a sector of the running erase command?
+static bool erase_hits(uint32_t addr, uint32_t len) {
+	if (erase.chip) return true;
+
+	for (uint32_t i = erase.next - erase.k; i < erase.next; ++i) {
+		struct len_and_block lab = info_of_address(erase.addrs[i]);
+		uint32_t start = erase.addrs[i] & ~(uint32_t)(lab.len - 1);
+		if (addr < start + lab.len && start < addr + len) return true;
+	}
+
+	return false;
+}
+// puts the running sector erase on hold, so other sectors can be read. false
+// if it can't be (chip erase) or didn't stop in time.
+static bool erase_suspend(void) {
+	if (erase.chip) return false;
+
+	uint32_t since = Delay_TicksToUs(Delay_GetTicks() - erase.t_resume);
+	if (since < SUSPEND_GAP_US) Delay_Us(SUSPEND_GAP_US - since);
+
+	uint32_t addr = erase.addrs[erase.next - 1];
+	erase.t_suspend = Delay_GetTicks();
+	if (drv->suspend(addr)) return true;
+
+	iprintf("[vkart] erase suspend at %08lx timed out\r\n", addr);
+	erase_resume(); // in case it does go through later
+	return false;
+}
+static void erase_resume(void) {
+	drv->resume(erase.addrs[erase.next - 1]);
+
+	// time spent suspended doesn't count against the erase timeout
+	erase.t_resume = Delay_GetTicks();
+	erase.t0 += erase.t_resume - erase.t_suspend;
+}
+// returns right away, vkart_erase_poll() until it's done
+static bool erase_chip_start(void) {
+	if (!drv->erase_chip()) return false;
+
+	erase.n = erase.next = erase.k = 0;
+	erase.time_us = 0;
+	erase.chip = true;
+	erase.failed = false;
+	erase.busy = true;
+	erase.t0 = Delay_GetTicks();
+	erase.elapsed_us = 0;
+
+	return true;
 }
 
 static uint16_t get_device_id(void) {
@@ -352,67 +1115,626 @@ static uint16_t get_device_id(void) {
 	return read_word(0x1);
 }
 static void do_reset(void) {
+	drv->reset();
+}
+static void bypass_enter(void) {
+	if (unlock_bypass) return;
+
+	write_word(0x0555, 0xAA);
+	write_word(0x02AA, 0x55);
+	write_word(0x0555, 0x20);
+	unlock_bypass = true;
+}
+static void bypass_leave(void) {
+	if (!unlock_bypass) return;
+
+	write_word(0x0000, 0x90);
+	write_word(0x0000, 0x00);
+	unlock_bypass = false;
+}
+
+// -- AMD style (MX29GL, M29W and friends)
+
+static void amd_reset(void) {
+	bypass_leave();
 	write_word(0x0, 0x00f0);
 }
+// write buffer if there is one, single words in unlock bypass otherwise
+static bool prog_mx(uint32_t addr, const uint16_t* pbuf, uint32_t len, uint32_t* skipped) {
+	if (!meta.wbuf_words) {
+		//iprintf("[vkart] single write at %08lx for len %08lx\r\n", addr, len);
+		for (uint32_t i = 0; i < len; ++i) {
+			if (pbuf[i] == 0xffff) {
+				++*skipped;
+				continue;
+			}
+			if (!write_word_mx(addr + i, pbuf[i])) return false;
+		}
+		return true;
+	}
 
-void vkart_read_data(uint32_t addr, uint16_t* buff, uint32_t len) {
-	set_data_dir(DATA_READ);
-	for (uint32_t i = 0; i < len; ++i) {
-		buff[i] = read_word(addr + i);
+	//iprintf("[vkart] buffer write at %08lx for len %08lx\r\n", addr, len);
+	for (uint32_t i = 0, n; i < len; i += n) {
+		// stay within one aligned write buffer page
+		n = page_chunk(addr + i, len - i, meta.wbuf_words);
+
+		uint32_t lo = i, hi = i + n;
+		*skipped += trim_blank(pbuf, &lo, &hi);
+		if (lo == hi) continue;
+
+		if (!write_buffer_mx(addr + lo, pbuf + lo, hi - lo)) {
+			// retry this page the slow way
+			for (uint32_t j = lo; j < hi; ++j) {
+				if (pbuf[j] == 0xffff) continue;
+				if (!write_word_mx(addr + j, pbuf[j])) return false;
+			}
+		}
 	}
+
+	return true;
 }
-void vkart_erase_sector(uint32_t addr, uint8_t block) {
-	iprintf("[vkart] erase sector addr %08lx for %d\r\n", addr, block);
-	erase_block(addr);
+// Quadruple/Double Program where the alignment allows
+static bool prog_m29w(uint32_t addr, const uint16_t* pbuf, uint32_t len, uint32_t* skipped) {
+	//iprintf("[vkart] multi write at %08lx for len %08lx\r\n", addr, len);
+	for (uint32_t i = 0, n; i < len; i += n) {
+		// biggest command that fits the alignment and what's left,
+		// unaligned heads and odd tails go out as single words
+		uint32_t a = addr + i, left = len - i;
+		if (meta.multi_words >= 4 && !(a & 3) && left >= 4) n = 4;
+		else if (!(a & 1) && left >= 2) n = 2;
+		else n = 1;
+
+		if (is_blank(pbuf + i, n)) {
+			*skipped += n;
+			continue;
+		}
+
+		bool ok;
+		if (n == 4) ok = write_quad_29w(a, pbuf + i);
+		else if (n == 2) ok = write_word_29w(a, pbuf[i], pbuf[i+1]);
+		else ok = write_word_mx(a, pbuf[i]);
+		if (!ok) return false;
+	}
+
+	return true;
+}
+static bool amd_erase_chip(void) {
 	do_reset();
+	write_word(0x0555, 0xaa);
+	write_word(0x02aa, 0x55);
+	write_word(0x0555, 0x80);
+	write_word(0x0555, 0xaa);
+	write_word(0x02aa, 0x55);
+	write_word(0x0555, 0x10);
+	return true;
+}
+static enum poll_result amd_erase_poll(uint32_t addr) {
+	// erased data is all ones, so DQ7 goes high once the sectors are done
+	return poll_once(addr, 0xffff, DQ5);
+}
+static bool amd_suspend(uint32_t addr) {
+	uint32_t t0 = Delay_GetTicks();
+
+	write_word(addr, 0xB0);
+
+	// DQ6 stops toggling once it's suspended (or done)
+	set_data_dir(DATA_READ);
+	uint16_t q = read_word(addr);
+	while (1) {
+		uint16_t q2 = read_word(addr);
+		if (!((q ^ q2) & DQ6)) return true;
+		q = q2;
+
+		if (Delay_TicksToUs(Delay_GetTicks() - t0) > SUSPEND_TIMEOUT_US) return false;
+	}
+}
+static void amd_resume(uint32_t addr) {
+	write_word(addr, 0x30);
+}
+
+static const struct chip_driver drv_mx29gl = {
+	.name = "MX29GL/AMD",
+	.reset = amd_reset,
+	.program = prog_mx,
+	.erase = amd_erase,
+	.erase_chip = amd_erase_chip,
+	.erase_poll = amd_erase_poll,
+	.suspend = amd_suspend,
+	.resume = amd_resume,
+};
+static const struct chip_driver drv_m29w = {
+	.name = "M29W",
+	.reset = amd_reset,
+	.program = prog_m29w,
+	.erase = amd_erase,
+	.erase_chip = amd_erase_chip,
+	.erase_poll = amd_erase_poll,
+	.suspend = amd_suspend,
+	.resume = amd_resume,
+};
+
+// -- Intel/Sharp style, everything goes through the status register
+
+// set while an erase is suspended, B0 on a finished erase doesn't suspend
+// anything and a D0 then would only be a command error
+static bool intel_suspended = false;
+
+static uint16_t intel_wait(uint32_t addr, uint32_t timeout_us) {
+	uint32_t t0 = Delay_GetTicks();
+	uint16_t sr;
+
+	set_data_dir(DATA_READ);
+	while (!((sr = read_word(addr)) & SR_READY)) {
+		if (Delay_TicksToUs(Delay_GetTicks() - t0) > timeout_us) break;
+	}
+
+	return sr;
+}
+static void intel_reset(void) {
+	write_word(0x0, 0x50);
+	write_word(0x0, 0xFF);
+}
+// blocks may power up locked (P30 and co), J3 style parts clear all of them
+static bool intel_unlock(uint32_t addr) {
+	write_word(addr, 0x60);
+	write_word(addr, 0xD0);
+	uint16_t sr = intel_wait(addr, meta.erase_timeout_us);
+	write_word(addr, 0x50);
+	return (sr & SR_READY) && !(sr & SR_ERRORS);
 }
-void vkart_write_data(const uint16_t *pbuf, uint32_t addr, uint32_t len) {
-	if (len < 2) return;
-
-	if (meta.support_double) {
-		//iprintf("[vkart] double write at %08lx for len %08lx\r\n", addr, len);
-		for (uint32_t i = 0; i < len; i += 2) {
-			//if ((pbuf[i] & pbuf[i+1]) == 0xffff) continue;
-			write_word_29w(addr + i, pbuf[i], pbuf[i+1]);
-			WAIT_SOME();
-			WAIT_SOME();
-			WAIT_SOME();
+// one buffered (n > 1, within a write buffer page) or word program. retried
+// once after an unlock if the block turns out to be locked.
+static bool intel_prog_one(uint32_t addr, const uint16_t* pbuf, uint32_t n) {
+	for (uint32_t tries = 0; tries < 2; ++tries) {
+		uint16_t sr;
+
+		if (n > 1) {
+			write_word(addr, 0xE8);
+			sr = intel_wait(addr, meta.buf_timeout_us); // buffer free
+			if (!(sr & SR_READY)) break;
+			write_word(addr, n - 1);
+			load_buffer(addr, pbuf, n);
+			write_word(addr, 0xD0);
+			sr = intel_wait(addr, meta.buf_timeout_us);
+		} else {
+			BUS_LOCKED({
+				bus_write(addr, 0x40);
+				bus_write(addr, pbuf[0]);
+			});
+			sr = intel_wait(addr, meta.prog_timeout_us);
 		}
-	} else {
-		//iprintf("[vkart] single write at %08lx for len %08lx\r\n", addr, len);
-		for (uint32_t i = 0; i < len; ++i) {
-			//if (pbuf[i] == 0xffff) continue;
-			write_word_mx(addr + i, pbuf[i]);
-			WAIT_SOME();
-			WAIT_SOME();
-			WAIT_SOME();
+
+		if ((sr & SR_READY) && !(sr & SR_ERRORS)) {
+			write_word(addr, 0xFF);
+			return true;
 		}
+		iprintf("[vkart] program at %08lx failed, status %02x\r\n", addr, sr);
+		write_word(addr, 0x50);
+		if (!(sr & SR_LOCKED) || !intel_unlock(addr)) break;
 	}
-	//iprintf("[vkart] prog %ld words done at %08lx\r\n", len, addr);
+
+	do_reset();
+	return false;
 }
+static bool intel_program(uint32_t addr, const uint16_t* pbuf, uint32_t len, uint32_t* skipped) {
+	uint32_t page = meta.wbuf_words ? meta.wbuf_words : 1;
 
-static void check_new_sector(void) {
-	if (!wrimage.new_sector) return;
-	wrimage.new_sector = false;
+	for (uint32_t i = 0, n; i < len; i += n) {
+		n = page_chunk(addr + i, len - i, page);
+
+		uint32_t lo = i, hi = i + n;
+		*skipped += trim_blank(pbuf, &lo, &hi);
+		if (lo == hi) continue;
 
-	bool blank = true;
+		if (!intel_prog_one(addr + lo, pbuf + lo, hi - lo)) return false;
+	}
+
+	return true;
+}
+// one block per command, no multi-block erase
+static uint32_t intel_erase(const uint32_t* addrs, uint32_t n) {
+	(void)n;
+
+	do_reset();
+	intel_unlock(addrs[0]);
+	write_word(addrs[0], 0x20);
+	write_word(addrs[0], 0xD0);
+	intel_suspended = false;
+	return 1;
+}
+static bool intel_erase_chip(void) {
+	return false;
+}
+static enum poll_result intel_erase_poll(uint32_t addr) {
 	set_data_dir(DATA_READ);
-	wrimage.act_typ = WAS_ERASED;
-	for (uint32_t i = 0; i < wrimage.blocklen; ++i) {
-		if (read_word(wrimage.blockaddr + i) != 0xffff) {
-			blank = false;
-			break;
+	uint16_t sr = read_word(addr);
+	if (!(sr & SR_READY)) return POLL_BUSY;
+	return (sr & SR_ERRORS) ? POLL_TIMEOUT : POLL_OK;
+}
+static bool intel_suspend(uint32_t addr) {
+	write_word(addr, 0xB0);
+	uint16_t sr = intel_wait(addr, SUSPEND_TIMEOUT_US);
+	if (!(sr & SR_READY)) return false;
+
+	intel_suspended = sr & SR_SUSPENDED;
+	write_word(addr, 0xFF);
+	return true;
+}
+static void intel_resume(uint32_t addr) {
+	if (intel_suspended) write_word(addr, 0xD0);
+	intel_suspended = false;
+	write_word(addr, 0x70); // erase_poll() reads status
+}
+
+static const struct chip_driver drv_intel = {
+	.name = "Intel/Sharp",
+	.reset = intel_reset,
+	.program = intel_program,
+	.erase = intel_erase,
+	.erase_chip = intel_erase_chip,
+	.erase_poll = intel_erase_poll,
+	.suspend = intel_suspend,
+	.resume = intel_resume,
+};
+
+void vkart_read_data(uint32_t addr, uint16_t* buff, uint32_t len) {
+	read_wait_dma();
+
+	if (!erase.busy) {
+		read_bus(addr, buff, len);
+		return;
+	}
+
+	// an erase is running in the background. other sectors can be read with
+	// it suspended, the ones being erased have to wait until it's done.
+	if (erase_hits(addr, len) || !erase_suspend()) {
+		while (vkart_erase_poll() == VKART_ERASE_BUSY)
+			;
+		read_bus(addr, buff, len);
+		return;
+	}
+
+	read_bus(addr, buff, len);
+	erase_resume();
+}
+void vkart_set_read_engine(enum vkart_read_engine engine) {
+	read_wait_dma();
+	read_engine = engine;
+	iprintf("[vkart] reads go through the %s\r\n",
+			(engine == VKART_READ_DMA) ? "DMA engine" : "CPU");
+}
+void vkart_read_start(uint32_t addr, uint16_t* pbuff, uint32_t len) {
+	read_wait_dma();
+	rd.addr = addr;
+	rd.dst = pbuff;
+	rd.len = len;
+	rd.off = 0;
+}
+bool vkart_read_poll(void) {
+	if (rd.n) {
+		if (!dma_read_done()) return false;
+		rd.off += rd.n;
+		rd.n = 0;
+	}
+	if (rd.off == rd.len) return true;
+
+	uint32_t addr = rd.addr + rd.off, todo = rd.len - rd.off;
+
+	// with an erase running, the sync path takes care of suspending it
+	if (read_engine == VKART_READ_DMA && !erase.busy) {
+		rd.n = dma_chunk(addr, todo);
+		dma_read_begin(addr, rd.dst + rd.off, rd.n);
+		return false;
+	}
+
+	if (todo > READ_SLICE_WORDS) todo = READ_SLICE_WORDS;
+	vkart_read_data(addr, rd.dst + rd.off, todo);
+	rd.off += todo;
+
+	return rd.off == rd.len;
+}
+bool vkart_erase_start(const uint32_t* addrs, uint32_t n) {
+	if (erase.busy || !n || n > ERASE_BATCH_MAX) return false;
+
+	memcpy(erase.addrs, addrs, n * sizeof(uint32_t));
+	erase.n = n;
+	erase.next = 0;
+	erase.time_us = 0;
+	erase.chip = false;
+	erase.failed = false;
+	erase.busy = true;
+	erase_issue();
+
+	return true;
+}
+enum vkart_erase_status vkart_erase_poll(void) {
+	if (!erase.busy) return erase.failed ? VKART_ERASE_FAILED : VKART_ERASE_DONE;
+
+	uint32_t ticks = Delay_GetTicks() - erase.t0;
+	if (ticks >= ERASE_FOLD_TICKS) {
+		erase.elapsed_us += Delay_TicksToUs(ticks);
+		erase.t0 += ticks;
+		ticks = 0;
+	}
+	uint32_t dt = erase.elapsed_us + Delay_TicksToUs(ticks);
+	uint32_t addr = erase.chip ? 0 : erase.addrs[erase.next - 1];
+	uint32_t timeout = erase.chip ? meta.chip_timeout_us
+		: clamp_timeout((uint64_t)meta.erase_timeout_us * erase.k);
+
+	enum poll_result r = drv->erase_poll(addr);
+	if (r == POLL_BUSY && dt < timeout) return VKART_ERASE_BUSY;
+
+	do_reset();
+	if (r != POLL_OK) {
+		iprintf("[vkart] erase at %08lx failed after %lu ms\r\n", addr, dt / 1000);
+		erase.busy = false;
+		erase.failed = true;
+		return VKART_ERASE_FAILED;
+	}
+
+	uint32_t k = erase.chip ? geometry.sectors : erase.k;
+	vkart_stats.sectors_erased += k;
+	vkart_stats.erase_us_total += dt;
+	if (dt > vkart_stats.erase_us_max) vkart_stats.erase_us_max = dt;
+	erase.time_us += dt;
+	if (erase.chip) {
+		iprintf("[vkart] chip erase took %lu ms\r\n", dt / 1000);
+	} else {
+		iprintf("[vkart] erase of %lu sectors at %08lx took %lu us\r\n",
+				k, erase.addrs[erase.next - k], dt);
+	}
+
+	if (erase.next < erase.n) { // the chip didn't take all of them at once
+		erase_issue();
+		return VKART_ERASE_BUSY;
+	}
+
+	erase.busy = false;
+	return VKART_ERASE_DONE;
+}
+bool vkart_erase_sectors(const uint32_t* addrs, uint32_t n, uint32_t* time_us) {
+	uint32_t total = 0;
+
+	for (uint32_t done = 0, k; done < n; done += k) {
+		k = (n - done > ERASE_BATCH_MAX) ? ERASE_BATCH_MAX : n - done;
+		if (!vkart_erase_start(addrs + done, k)) return false;
+
+		enum vkart_erase_status st;
+		while ((st = vkart_erase_poll()) == VKART_ERASE_BUSY)
+			;
+		if (st != VKART_ERASE_DONE) return false;
+		total += erase.time_us;
+	}
+	if (time_us) *time_us = total;
+
+	return true;
+}
+bool vkart_erase_sector(uint32_t addr, uint16_t block, uint32_t* time_us) {
+	iprintf("[vkart] erase sector addr %08lx for %d\r\n", addr, block);
+	return vkart_erase_sectors(&addr, 1, time_us);
+}
+// programming a word to 0xffff doesn't change anything, so those get skipped
+// (whole groups only for the multi-word commands, to keep their alignment)
+static bool is_blank(const uint16_t* pbuf, uint32_t n) {
+	for (uint32_t i = 0; i < n; ++i) {
+		if (pbuf[i] != 0xffff) return false;
+	}
+	return true;
+}
+bool vkart_write_data(const uint16_t *pbuf, uint32_t addr, uint32_t len) {
+	uint32_t skipped = 0;
+
+	if (!len) return true;
+
+	if (!drv->program(addr, pbuf, len, &skipped)) return false;
+	//iprintf("[vkart] prog %ld words done at %08lx\r\n", len, addr);
+
+	vkart_stats.words_programmed += len - skipped;
+	vkart_stats.words_skipped += skipped;
+
+	return true;
+}
+
+// a sector can get a same-data check if whatever already passed the check can
+// be put back after an erase: small ones from wrimage_buf, large ones from the
+// internal flash stage.
+static bool can_same_check(uint32_t len) {
+	return len <= VKART_BUFFER_WORDSZ || len * sizeof(uint16_t) <= INT_FLASH_STAGE_SIZE;
+}
+// internal flash pages only take one program after an erase, so the stage
+// gets filled front to back through a RAM page
+static struct {
+	uint32_t page[INT_FLASH_PAGE_SIZE/4];
+	uint32_t len;  // words appended
+	uint32_t done; // words programmed, only a stage_flush() leaves a partial page
+} stage;
+
+// start the stage over with the first len words of the sector at addr
+static bool stage_save(uint32_t addr, uint32_t len) {
+	uint16_t* chunk = slice;
+
+	int_flash_stage_erase();
+	stage.len = stage.done = 0;
+	memset(stage.page, 0xff, sizeof stage.page);
+
+	for (uint32_t off = 0, todo = STAGE_PAGE_WORDS; off < len; off += todo) {
+		if (off + todo > len) todo = len - off;
+
+		read_burst(addr + off, chunk, todo);
+		if (!stage_append(chunk, todo)) return false;
+	}
+
+	return true;
+}
+static bool stage_append(const uint16_t* pbuf, uint32_t n) {
+	uint16_t* page = (uint16_t*)stage.page;
+
+	while (n) {
+		uint32_t i = stage.len % STAGE_PAGE_WORDS, k = STAGE_PAGE_WORDS - i;
+		if (k > n) k = n;
+
+		memcpy(page + i, pbuf, k * sizeof(uint16_t));
+		pbuf += k;
+		n -= k;
+		stage.len += k;
+		if (!(stage.len % STAGE_PAGE_WORDS) && !stage_flush()) return false;
+	}
+
+	return true;
+}
+// program the page being filled, padded with 0xffff. nothing can be appended
+// after flushing a partial page.
+static bool stage_flush(void) {
+	if (stage.done == stage.len) return true;
+
+	uint32_t off = stage.done / STAGE_PAGE_WORDS * INT_FLASH_PAGE_SIZE;
+	bool ok = int_flash_stage_program(off, stage.page);
+	if (!ok) iprintf("[vkart] wrimage: staging failed at %08lx\r\n", off);
+
+	stage.done = stage.len;
+	memset(stage.page, 0xff, sizeof stage.page);
+	return ok;
+}
+// keep data of a sector that's being erased, to write it back later
+static bool spool(const uint16_t* pbuf, uint32_t n) {
+	if (wrimage.blocklen <= VKART_BUFFER_WORDSZ) {
+		memcpy(&wrimage_buf[wrimage.off_in_block], pbuf, n * sizeof(uint16_t));
+		return true;
+	}
+
+	return stage_append(pbuf, n);
+}
+// the rollback erase is running: take this sector's data into the stage
+// meanwhile, afterwards write it all back a slice at a time. BUSY means the
+// caller has to come back, vkart_wrimage_pos() says how much got taken.
+static enum vkart_wrimage_status restore_step(const uint16_t* pbuf, uint32_t len) {
+	if (erase.busy) {
+		uint32_t todo = wrimage.blocklen - wrimage.off_in_block;
+		if (!todo) return VKART_WRIMAGE_BUSY; // it's all here, wait for the erase
+		if (todo > len) todo = len;
+
+		if (todo && !spool(pbuf, todo)) return VKART_WRIMAGE_ERR_PROG;
+		wrimage.crc = crc32(wrimage.crc, pbuf, todo * sizeof(uint16_t));
+		wrimage.off_in_block += todo;
+		return (len > todo) ? VKART_WRIMAGE_BUSY : VKART_WRIMAGE_MORE;
+	}
+
+	bool small = wrimage.blocklen <= VKART_BUFFER_WORDSZ;
+	if (!small && !stage_flush()) return VKART_WRIMAGE_ERR_PROG;
+
+	const uint16_t* saved = small ? wrimage_buf : int_flash_stage_data();
+	uint32_t n = wrimage.off_in_block - wrimage.restored;
+	if (n > RESTORE_SLICE_WORDS) n = RESTORE_SLICE_WORDS;
+	if (!vkart_write_data(saved + wrimage.restored, wrimage.blockaddr + wrimage.restored, n)) {
+		return VKART_WRIMAGE_ERR_PROG;
+	}
+	wrimage.restored += n;
+	if (wrimage.restored < wrimage.off_in_block) return VKART_WRIMAGE_BUSY;
+
+	iprintf("[vkart] wrimage: restored %lu words at %08lx\r\n", wrimage.restored, wrimage.blockaddr);
+	wrimage.restore = false;
+	if (wrimage.off_in_block == wrimage.blocklen) {
+		if (wrimage.blockaddr + wrimage.blocklen >= geometry.words) return VKART_WRIMAGE_END;
+		start_new_sector();
+		if (wrimage.restore) return VKART_WRIMAGE_BUSY; // it read back wrong, once more
+	}
+
+	return VKART_WRIMAGE_MORE;
+}
+static bool is_erased_ahead(uint16_t block) {
+	return (wrimage.erased_ahead[block >> 5] >> (block & 31)) & 1;
+}
+// the current sector needs an erase: start it in the background, and take
+// along the sectors right after it that the image also covers and that are
+// known to need one as well: non-blank and unable to get a same-data check,
+// or any non-blank one when the host asked for everything to be erased.
+static bool erase_run(void) {
+	uint32_t addrs[ERASE_BATCH_MAX];
+	uint16_t blocks[ERASE_BATCH_MAX];
+	uint32_t n = 0, addr = wrimage.blockaddr;
+	struct len_and_block lab = { .len = wrimage.blocklen, .block = wrimage.block };
+
+	do {
+		addrs[n] = addr;
+		blocks[n] = lab.block;
+		++n;
+
+		addr += lab.len;
+		if (addr >= wrimage.known_end || addr >= geometry.words) break;
+		lab = info_of_address(addr);
+	} while (n < ERASE_BATCH_MAX && (wrimage.erase_all || !can_same_check(lab.len))
+			&& !read_is_blank(addr, lab.len));
+
+	if (n > 1) {
+		iprintf("[vkart] wrimage: erasing %lu sectors from block %d at once\r\n", n, wrimage.block);
+	}
+	if (!vkart_erase_start(addrs, n)) return false;
+
+	for (uint32_t i = 1; i < n; ++i) {
+		wrimage.erased_ahead[blocks[i] >> 5] |= 1u << (blocks[i] & 31);
+	}
+
+	return true;
+}
+enum patch_result {
+	PATCH_OK = 0,     // flash now holds the data, without an erase
+	PATCH_NEED_ERASE, // some bit would have to go from 0 to 1
+	PATCH_FAILED,     // the chip reported a program failure
+};
+// NOR programming can only clear bits: if every new word only clears bits of
+// what's in the flash already ((old & new) == new), program the differing
+// words in place. anything programmed before finding a word that doesn't fit
+// is undone by the caller's erase & rewrite from wrimage_buf or the stage.
+static enum patch_result patch_in_place(uint32_t addr, const uint16_t* pbuf, uint32_t len) {
+	uint16_t* chunk = slice;
+
+	for (uint32_t off = 0, todo = SLICE_WORDS; off < len; off += todo) {
+		if (off + todo > len) todo = len - off;
+
+		read_burst(addr + off, chunk, todo);
+		for (uint32_t i = 0; i < todo; ++i) {
+			uint16_t old = chunk[i], new = pbuf[off + i];
+			if ((old & new) != new) {
+				iprintf("[vkart] wrimage: same check failed! at %08lx: have %04x, write %04x\r\n",
+						addr + off + i, old, new);
+				return PATCH_NEED_ERASE;
+			}
+			chunk[i] = (old == new) ? 0xffff : new; // 0xffff gets skipped
+		}
+
+		if (!is_blank(chunk, todo)) {
+			iprintf("[vkart] wrimage: programming in place at %08lx\r\n", addr + off);
+			if (!vkart_write_data(chunk, addr + off, todo)) return PATCH_FAILED;
 		}
 	}
 
+	return PATCH_OK;
+}
+static bool check_new_sector(void) {
+	if (!wrimage.new_sector) return true;
+	wrimage.new_sector = false;
+
+	if (wrimage.chip_erased) {
+		wrimage.act_typ = WAS_ERASED;
+		return true;
+	}
+	if (is_erased_ahead(wrimage.block)) {
+		wrimage.erased_ahead[wrimage.block >> 5] &= ~(1u << (wrimage.block & 31));
+		wrimage.act_typ = WAS_ERASED;
+		return true;
+	}
+
+	bool blank = read_is_blank(wrimage.blockaddr, wrimage.blocklen);
+	wrimage.act_typ = WAS_ERASED;
+
 	if (blank) {
 		set_data_dir(DATA_WRITE);
 		wrimage.act_typ = WAS_ERASED;
-		iprintf("[vkart] wrimage: clean, only write for %08lx (block %d len %06x)\r\n",
+		iprintf("[vkart] wrimage: clean, only write for %08lx (block %d len %06lx)\r\n",
 				wrimage.blockaddr, wrimage.block, wrimage.blocklen);
-	} else if (wrimage.blocklen > VKART_BUFFER_WORDSZ) {
-		// can't buffer, so can't do a wear-levelling check -> no other choice
-		// but to erase the entire sector.
+	} else if (!can_same_check(wrimage.blocklen) || wrimage.erase_all) {
+		// can't keep what we've checked around over an erase -> no other
+		// choice but to erase the entire sector.
 		wrimage.act_typ = ERASE_REWRITE_FULL;
 		iprintf("[vkart] wrimage: full erase & rewrite\r\n");
 	} else {
@@ -421,92 +1743,333 @@ static void check_new_sector(void) {
 	}
 
 	if (wrimage.act_typ == ERASE_REWRITE_FULL) {
-		vkart_erase_sector(wrimage.blockaddr, wrimage.block);
+		return erase_run();
+	}
+
+	return true;
+}
+static struct vkart_bad_sector* find_bad(uint32_t addr) {
+	for (uint32_t i = 0; i < num_bad; ++i) {
+		if (bad[i].addr == addr) return &bad[i];
+	}
+	return NULL;
+}
+// keeps the CRC of the image data for the host, tries carry over from an
+// earlier repair of the same sector
+static void sector_bad(uint32_t addr, uint32_t len, uint32_t crc) {
+	if (!vkart_stats.sectors_bad) vkart_stats.first_bad_addr = addr;
+	++vkart_stats.sectors_bad;
+
+	if (find_bad(addr)) return;
+	if (num_bad == VKART_BAD_SECTORS_MAX) {
+		bad_lost = true;
+		return;
+	}
+	bad[num_bad].addr = addr;
+	bad[num_bad].len = len;
+	bad[num_bad].crc = crc;
+	bad[num_bad].tries = 0;
+	++num_bad;
+}
+static void sector_good(uint32_t addr) {
+	++vkart_stats.sectors_verified;
+
+	struct vkart_bad_sector* b = find_bad(addr);
+	if (!b) return;
+	iprintf("[vkart] wrimage: sector at %08lx repaired\r\n", addr);
+	++vkart_stats.sectors_repaired;
+	*b = bad[--num_bad];
+}
+static bool reads_back(uint32_t addr, const uint16_t* pbuf, uint32_t len) {
+	uint16_t* chunk = slice;
+
+	for (uint32_t off = 0, n; off < len; off += n) {
+		n = (len - off > SLICE_WORDS) ? SLICE_WORDS : len - off;
+		vkart_read_data(addr + off, chunk, n);
+		if (memcmp(chunk, pbuf + off, n * sizeof(uint16_t))) return false;
+	}
+
+	return true;
+}
+// small sectors still have all their data in wrimage_buf when they're done:
+// check them right away. a bad one gets erased in the background and written
+// back by restore_step(), like after a failed same check. false while that
+// runs, restore_step() comes back here once it's done.
+static bool verify_small(void) {
+	uint32_t addr = wrimage.blockaddr, len = wrimage.off_in_block;
+
+	if (reads_back(addr, wrimage_buf, len)) {
+		sector_good(addr);
+		return true;
+	}
+	if (wrimage.rewrites < REPAIR_TRIES && vkart_erase_start(&addr, 1)) {
+		++wrimage.rewrites;
+		iprintf("[vkart] wrimage: sector %d at %08lx reads back wrong, rewriting it (%d)\r\n",
+				wrimage.block, addr, wrimage.rewrites);
+		wrimage.restore = true;
+		wrimage.restored = 0;
+		return false;
+	}
+
+	iprintf("[vkart] wrimage: giving up on sector %d at %08lx\r\n", wrimage.block, addr);
+	sector_bad(addr, len, wrimage.crc);
+	return true;
+}
+// one slice of the oldest sector's readback. it comes in a piece at a time
+// through the background read, with DMA the CPU does the CRC of the piece
+// before while the next one is being read.
+static void verify_step(void) {
+	if (!verify.count) return;
+
+	struct verify_entry* e = &verify_queue[verify.head];
+	uint32_t n = e->len - verify.off, prev = 0;
+	if (n > SLICE_WORDS) n = SLICE_WORDS;
+
+	for (uint32_t off = 0, k; off < n; off += k) {
+		k = (n - off > VERIFY_PIECE_WORDS) ? VERIFY_PIECE_WORDS : n - off;
+		vkart_read_start(e->addr + verify.off + off, slice + off, k);
+		vkart_read_poll(); // gets the DMA run going
+		if (prev) verify.acc = crc32(verify.acc, slice + off - prev, prev * sizeof(uint16_t));
+		while (!vkart_read_poll())
+			;
+		prev = k;
+	}
+	verify.acc = crc32(verify.acc, slice + n - prev, prev * sizeof(uint16_t));
+	verify.off += n;
+	if (verify.off < e->len) return;
+
+	if (verify.acc == e->crc) {
+		sector_good(e->addr);
+	} else {
+		iprintf("[vkart] wrimage: sector %d at %08lx reads back wrong (crc %08lx, wrote %08lx)\r\n",
+				e->block, e->addr, verify.acc, e->crc);
+		sector_bad(e->addr, e->len, e->crc);
+	}
+
+	verify.head = (verify.head + 1) % VERIFY_QUEUE_LEN;
+	--verify.count;
+	verify.off = 0;
+	verify.acc = 0;
+}
+// the current sector is done being written, queue up its readback. false
+// if it's getting rewritten instead, see verify_small().
+static bool verify_current(void) {
+	if (!wrimage.off_in_block) return true;
+
+	// a resend has to be the same data the image had there
+	struct vkart_bad_sector* b = repairing ? find_bad(wrimage.blockaddr) : NULL;
+	if (b && (wrimage.off_in_block != b->len || wrimage.crc != b->crc)) {
+		iprintf("[vkart] wrimage: resent data for %08lx doesn't match the image\r\n",
+				wrimage.blockaddr);
+		++vkart_stats.sectors_bad;
+		return true;
 	}
+	if (wrimage.blocklen <= VKART_BUFFER_WORDSZ) return verify_small();
+
+	while (verify.count == VERIFY_QUEUE_LEN) verify_step();
+
+	struct verify_entry* e = &verify_queue[(verify.head + verify.count) % VERIFY_QUEUE_LEN];
+	e->addr = wrimage.blockaddr;
+	e->len = wrimage.off_in_block;
+	e->crc = wrimage.crc;
+	e->block = wrimage.block;
+	++verify.count;
+	return true;
 }
 static void start_new_sector(void) {
+	if (!verify_current()) return; // stays on it, restore_step() calls again
+	wrimage.crc = 0;
+	wrimage.rewrites = 0;
 	wrimage.blockaddr += wrimage.blocklen;
 	struct len_and_block lab = info_of_address(wrimage.blockaddr);
 	wrimage.block = lab.block;
 	wrimage.blocklen = lab.len;
 	wrimage.off_in_block = 0;
 
-	//iprintf("[vkart] wrimage: new sector %08lx %d len %06x\r\n", wrimage.blockaddr, wrimage.block, wrimage.blocklen);
+	//iprintf("[vkart] wrimage: new sector %08lx %d len %06lx\r\n", wrimage.blockaddr, wrimage.block, wrimage.blocklen);
 
 	wrimage.new_sector = true;
 }
 
-bool vkart_wrimage_start(void) {
-	if (wrimage.block != 0xff) return false;
-
-	iprintf("[vkart] wrimage: start\r\n");
+static void wrimage_begin(uint32_t addr, uint32_t len_hint) {
+	memset(&vkart_stats, 0, sizeof vkart_stats);
+	irq_off_max = 0;
+	erase.failed = false;
 
 	wrimage.new_sector = false;
-	wrimage.blockaddr = 0;
+	wrimage.blockaddr = addr;
 	wrimage.blocklen = 0;
+	wrimage.known_end = addr + len_hint;
+	memset(wrimage.erased_ahead, 0, sizeof wrimage.erased_ahead);
+	wrimage.chip_erased = false;
+	wrimage.chip_erasing = false;
+	wrimage.erase_all = false;
+	wrimage.tail_queued = false;
+	wrimage.restore = false;
+	wrimage.off_in_block = 0;
+	verify.head = verify.count = 0;
+	verify.off = verify.acc = 0;
 	start_new_sector();
+}
+bool vkart_wrimage_start(uint32_t len_hint, enum vkart_wrimage_mode mode) {
+	if (wrimage.block != NO_BLOCK) return false;
+
+	iprintf("[vkart] wrimage: start\r\n");
+
+	num_bad = 0;
+	bad_lost = false;
+	repairing = false;
+	wrimage_begin(0, len_hint);
+
+	if (mode == VKART_WRIMAGE_CHIP_ERASE) {
+		if (erase_chip_start()) {
+			iprintf("[vkart] wrimage: chip erase\r\n");
+			wrimage.chip_erasing = true;
+		} else {
+			iprintf("[vkart] wrimage: no chip erase on %s, erasing by sector\r\n", drv->name);
+			wrimage.erase_all = true;
+		}
+	}
+
+	return true;
+}
+bool vkart_wrimage_repair(uint32_t addr) {
+	if (wrimage.block != NO_BLOCK) return false;
+
+	struct vkart_bad_sector* b = find_bad(addr);
+	if (!b) {
+		iprintf("[vkart] wrimage: nothing to repair at %08lx\r\n", addr);
+		return false;
+	}
+	if (b->tries >= REPAIR_TRIES) {
+		iprintf("[vkart] wrimage: sector at %08lx failed %d repairs, giving up\r\n", addr, b->tries);
+		return false;
+	}
+	++b->tries;
+	iprintf("[vkart] wrimage: repair %08lx, %lu words (%d)\r\n", addr, b->len, b->tries);
 
+	repairing = true;
+	repair_addr = addr;
+	wrimage_begin(addr, b->len);
 	return true;
 }
-bool vkart_wrimage_next(const uint16_t* pbuf, uint32_t len) {
+const struct vkart_bad_sector* vkart_wrimage_bad_sectors(uint32_t* n) {
+	*n = num_bad;
+	return bad;
+}
+enum vkart_wrimage_status vkart_wrimage_poll(void) {
+	enum vkart_erase_status st = vkart_erase_poll();
+	if (st == VKART_ERASE_BUSY) {
+		// a rollback erase still takes the rest of its sector meanwhile
+		bool room = wrimage.off_in_block < wrimage.blocklen;
+		return (wrimage.restore && room) ? VKART_WRIMAGE_MORE : VKART_WRIMAGE_BUSY;
+	}
+
+	bool chip = wrimage.chip_erasing;
+	wrimage.chip_erasing = false;
+	if (st == VKART_ERASE_FAILED) return VKART_WRIMAGE_ERR_ERASE;
+
+	if (chip) wrimage.chip_erased = true;
+
+	return VKART_WRIMAGE_MORE;
+}
+uint32_t vkart_wrimage_pos(void) {
+	return wrimage.blockaddr + wrimage.off_in_block;
+}
+enum vkart_wrimage_status vkart_wrimage_next(const uint16_t* pbuf, uint32_t len) {
+	// readbacks wait out a rollback erase, they'd have to suspend it for every piece
+	if (!erase.busy) verify_step();
+
+	if (wrimage.restore) {
+		enum vkart_wrimage_status st = restore_step(pbuf, len);
+		if (st != VKART_WRIMAGE_MORE || wrimage.restore) return st;
+		// written back (none of pbuf taken), carry on with it as usual
+	}
+	if (erase.busy) return VKART_WRIMAGE_BUSY;
+	if (!len) return VKART_WRIMAGE_MORE;
+
 	uint32_t todo = len;
 	bool end = false;
 	if (wrimage.off_in_block + todo > wrimage.blocklen) {
 		todo = wrimage.blocklen - wrimage.off_in_block;
 	}
 
-	if (wrimage.blockaddr + wrimage.off_in_block + todo >= VKART_MEMORY_WORDSZ) {
-		todo = VKART_MEMORY_WORDSZ - (wrimage.blockaddr + wrimage.off_in_block);
+	if (wrimage.blockaddr + wrimage.off_in_block + todo >= geometry.words) {
+		todo = geometry.words - (wrimage.blockaddr + wrimage.off_in_block);
 		end = true; // don't tailcall!
 	}
 
+	uint32_t pos = wrimage.blockaddr + wrimage.off_in_block;
+	if (repairing) {
+		// a resend only covers its sector, anything past that is dropped
+		// instead of going over sectors that are fine
+		if (pos + todo >= wrimage.known_end) {
+			todo = wrimage.known_end - pos;
+			end = true;
+			if (!todo) return VKART_WRIMAGE_END;
+		}
+	} else if (pos + len > wrimage.known_end) {
+		wrimage.known_end = pos + len;
+	}
+
 	//iprintf("[vkart] wrimage: next %06lx, will do %06lx\r\n", len, todo);
 	if (end) {
 		iprintf("[vkart] wrimage: REACHES END\r\n");
 	}
 
-	check_new_sector();
+	if (!check_new_sector()) return VKART_WRIMAGE_ERR_ERASE;
+	if (erase.busy) return VKART_WRIMAGE_BUSY; // come back with the same data
+
+	// small sectors keep their data around, for the same check and the readback
+	bool small = wrimage.blocklen <= VKART_BUFFER_WORDSZ;
+	if (small) memcpy(&wrimage_buf[wrimage.off_in_block], pbuf, todo * sizeof(uint16_t));
 
 	if (wrimage.act_typ == ERASE_REWRITE_FULL || wrimage.act_typ == WAS_ERASED) {
-		vkart_write_data(pbuf, wrimage.blockaddr + wrimage.off_in_block, todo);
+		if (!vkart_write_data(pbuf, wrimage.blockaddr + wrimage.off_in_block, todo)) {
+			return VKART_WRIMAGE_ERR_PROG;
+		}
 	} else if (wrimage.act_typ == SAME_CHECK_BUSY) {
-		bool failed = false;
-
-		set_data_dir(DATA_READ);
-
-		memcpy(&wrimage_buf[wrimage.off_in_block], pbuf, todo * sizeof(uint16_t));
-
 		iprintf("[vkart] wrimage: same check from %08lx len %06lx...\r\n",
 				wrimage.blockaddr + wrimage.off_in_block, todo);
-		for (uint32_t i = 0; i < todo; ++i) {
-			uint16_t memv = read_word(wrimage.blockaddr + wrimage.off_in_block + i);
-			if (memv != pbuf[i]) {
-				failed = true; // oh no!
-				iprintf("[vkart] wrimage: same check failed! at %08lx: have %04x, write %04x\r\n",
-						wrimage.blockaddr + wrimage.off_in_block + i, memv, pbuf[i]);
-				break;
-			}
-		}
+		enum patch_result pr = patch_in_place(wrimage.blockaddr + wrimage.off_in_block, pbuf, todo);
+		if (pr == PATCH_FAILED) return VKART_WRIMAGE_ERR_PROG;
 
-		if (failed) {
+		if (pr == PATCH_NEED_ERASE && !small && !wrimage.off_in_block) {
+			// nothing of the sector passed the check yet, so there's nothing
+			// to keep over the erase and no reason to wear out the stage:
+			// erase it (and what follows) and write it like any other
+			iprintf("[vkart] wrimage: selfcheck recover: erasing from %08lx\r\n", wrimage.blockaddr);
+			wrimage.act_typ = ERASE_REWRITE_FULL;
+			if (!erase_run()) return VKART_WRIMAGE_ERR_ERASE;
+			return VKART_WRIMAGE_BUSY; // come back with the same data
+		} else if (pr == PATCH_NEED_ERASE) {
 			iprintf("[vkart] wrimage: selfcheck recover: erasing & writing buffer, len %08lx\r\n",
 					wrimage.off_in_block + todo);
 			wrimage.act_typ = ERASE_REWRITE_FULL;
-			vkart_erase_sector(wrimage.blockaddr, wrimage.block);
-
-			vkart_write_data(wrimage_buf, wrimage.blockaddr, wrimage.off_in_block + todo);
+			// everything before off_in_block already holds the new data, keep
+			// it in the stage over the erase, followed by this chunk and
+			// whatever else of the sector comes in while it runs
+			if (!small && (!stage_save(wrimage.blockaddr, wrimage.off_in_block)
+					|| !stage_append(pbuf, todo))) {
+				return VKART_WRIMAGE_ERR_PROG;
+			}
+			if (!erase_run()) return VKART_WRIMAGE_ERR_ERASE;
+			wrimage.restore = true;
+			wrimage.restored = 0;
 		} else {
 			iprintf("[vkart] wrimage: same check passed, continuing...\r\n");
 		}
 	}
 
+	wrimage.crc = crc32(wrimage.crc, pbuf, todo * sizeof(uint16_t));
 	wrimage.off_in_block += todo;
 	if (wrimage.off_in_block == wrimage.blocklen) {
 		if (end) { // we've reached the end of our flash memory, need to stop
-			return end;
+			return VKART_WRIMAGE_END;
 		}
 
-		start_new_sector();
+		// with a restore pending, restore_step() moves on once it's done
+		if (!wrimage.restore) start_new_sector();
 	}
 
 	if (!end && len > todo) {
@@ -514,14 +2077,120 @@ bool vkart_wrimage_next(const uint16_t* pbuf, uint32_t len) {
 		iprintf("[vkart] wrimage: tailcall!\r\n");
 
 		return vkart_wrimage_next(pbuf + todo, len - todo); // tailcall
-	} else return end;
+	} else return end ? VKART_WRIMAGE_END : VKART_WRIMAGE_MORE;
+}
+// the rollback erase or write-back failed, the host can resend the sector
+static void restore_lost(void) {
+	iprintf("[vkart] wrimage: sector at %08lx lost its write-back\r\n", wrimage.blockaddr);
+	sector_bad(wrimage.blockaddr, wrimage.off_in_block, wrimage.crc);
+	wrimage.restore = false;
+	wrimage.tail_queued = true;
+}
+bool vkart_wrimage_drain(void) {
+	if (wrimage.block == NO_BLOCK) return true;
+
+	// can't stop an erase, let it run out so the next user sees a sane
+	// chip, and write back whatever still sits in the stage or wrimage_buf
+	enum vkart_wrimage_status st = vkart_wrimage_poll();
+	if (st == VKART_WRIMAGE_BUSY) return false;
+	if (st != VKART_WRIMAGE_MORE && wrimage.restore) restore_lost();
+	if (wrimage.restore) {
+		st = vkart_wrimage_next(NULL, 0);
+		if (st == VKART_WRIMAGE_ERR_PROG) restore_lost();
+		else if (st == VKART_WRIMAGE_BUSY || wrimage.restore) return false;
+	}
+
+	// whatever of the last sector got written, then the rest of the
+	// readbacks. a rewrite of the last sector goes through the restore too.
+	if (!wrimage.tail_queued) {
+		if (verify.count == VERIFY_QUEUE_LEN) {
+			verify_step();
+			return false;
+		}
+		if (!verify_current()) return false;
+		wrimage.tail_queued = true;
+	}
+	if (verify.count) {
+		verify_step();
+		return false;
+	}
+
+	return true;
 }
-void vkart_wrimage_finish(void) {
-	if (wrimage.block == 0xff) return;
+bool vkart_wrimage_finish(void) {
+	if (wrimage.block == NO_BLOCK) return true;
 
-	wrimage.block = 0xff;
+	while (!vkart_wrimage_drain())
+		;
+	do_reset();
+
+	wrimage.restore = false;
+	wrimage.block = NO_BLOCK;
 	wrimage.new_sector = false;
 
-	iprintf("[vkart] wrimage: done\r\n");
+	iprintf("[vkart] wrimage: done, erased %lu sectors in %lu ms (max %lu ms)\r\n",
+			vkart_stats.sectors_erased, vkart_stats.erase_us_total / 1000,
+			vkart_stats.erase_us_max / 1000);
+	iprintf("[vkart] wrimage: programmed %lu words, skipped %lu blank ones\r\n",
+			vkart_stats.words_programmed, vkart_stats.words_skipped);
+	vkart_stats.irq_off_us_max = Delay_TicksToUs(irq_off_max);
+	iprintf("[vkart] wrimage: IRQs masked for at most %lu us at a time\r\n",
+			vkart_stats.irq_off_us_max);
+	iprintf("[vkart] wrimage: %lu sectors read back fine (%lu repaired), %lu bad\r\n",
+			vkart_stats.sectors_verified, vkart_stats.sectors_repaired, vkart_stats.sectors_bad);
+
+	// a repair only answers for its own sector, the host asks for the rest
+	if (repairing) {
+		repairing = false;
+		return !vkart_stats.sectors_bad && !find_bad(repair_addr);
+	}
+	if (bad_lost) iprintf("[vkart] wrimage: too many bad sectors to repair, rewrite it all\r\n");
+	return !num_bad && !bad_lost && !vkart_stats.sectors_bad;
 }
 
+#ifdef VKART_BENCH
+// compare the per-word read path against the burst and DMA engines on the start of the
+// cart, results go out over the debug UART
+void vkart_bench(void) {
+	const uint32_t rounds = 16, words = VKART_BUFFER_WORDSZ;
+	uint16_t* buf = vkart_data_buffer;
+	uint32_t t0, t_word, t_burst, t_dma, crc_word = 0, crc_burst = 0, crc_dma = 0;
+
+	irq_off_max = 0;
+
+	t0 = Delay_GetTicks();
+	for (uint32_t r = 0; r < rounds; ++r) {
+		set_data_dir(DATA_READ);
+		for (uint32_t i = 0; i < words; ++i) buf[i] = read_word(r * words + i);
+		crc_word = crc32(crc_word, buf, words * sizeof(uint16_t));
+	}
+	t_word = Delay_TicksToUs(Delay_GetTicks() - t0);
+
+	t0 = Delay_GetTicks();
+	for (uint32_t r = 0; r < rounds; ++r) {
+		read_burst(r * words, buf, words);
+		crc_burst = crc32(crc_burst, buf, words * sizeof(uint16_t));
+	}
+	t_burst = Delay_TicksToUs(Delay_GetTicks() - t0);
+
+	t0 = Delay_GetTicks();
+	for (uint32_t r = 0; r < rounds; ++r) {
+		read_dma(r * words, buf, words);
+		crc_dma = crc32(crc_dma, buf, words * sizeof(uint16_t));
+	}
+	t_dma = Delay_TicksToUs(Delay_GetTicks() - t0);
+
+	iprintf("[vkart] bench read_word: %lu words in %lu us (%lu w/s)\r\n", rounds * words,
+			t_word, (uint32_t)((uint64_t)rounds * words * 1000000 / (t_word ? t_word : 1)));
+	iprintf("[vkart] bench read_burst: %lu words in %lu us (%lu w/s)\r\n", rounds * words,
+			t_burst, (uint32_t)((uint64_t)rounds * words * 1000000 / (t_burst ? t_burst : 1)));
+	iprintf("[vkart] bench read_dma: %lu words in %lu us (%lu w/s)\r\n", rounds * words,
+			t_dma, (uint32_t)((uint64_t)rounds * words * 1000000 / (t_dma ? t_dma : 1)));
+	if (crc_word != crc_burst || crc_word != crc_dma) {
+		iprintf("[vkart] bench MISMATCH: %08lx vs %08lx vs %08lx\r\n",
+				crc_word, crc_burst, crc_dma);
+	}
+	iprintf("[vkart] bench: IRQs masked for at most %lu us at a time (%d word chunks)\r\n",
+			Delay_TicksToUs(irq_off_max), VKART_IRQ_CHUNK_WORDS);
+}
+#endif
@@ -0,0 +1,130 @@
+
+#include <stdint.h>
+#include <stdbool.h>
+#include <stdio.h>
+
+#include "vkart_flash.h"
+#include "vkart_jobs.h"
+
+// most we program per vkart_job_task() call, about 1..2 ms
+#define JOB_SLICE_WORDS 256
+
+static struct vkart_job* queue[VKART_JOB_QUEUE_LEN];
+static uint8_t q_head, q_count;
+
+bool vkart_job_submit(struct vkart_job* job) {
+	if (q_count == VKART_JOB_QUEUE_LEN) return false;
+
+	job->off = 0;
+	job->started = false;
+	queue[(q_head + q_count) % VKART_JOB_QUEUE_LEN] = job;
+	++q_count;
+
+	return true;
+}
+bool vkart_job_idle(void) {
+	return q_count == 0;
+}
+void vkart_job_flush(void) {
+	q_count = 0;
+}
+
+static void complete(struct vkart_job* job, enum vkart_job_result res) {
+	q_head = (q_head + 1) % VKART_JOB_QUEUE_LEN;
+	--q_count;
+	if (job->done) job->done(job, res);
+}
+
+// returns true once the job is done, *res says how it went
+static bool step_program(struct vkart_job* job, enum vkart_job_result* res) {
+	enum vkart_wrimage_status st = vkart_wrimage_poll();
+	if (st == VKART_WRIMAGE_BUSY) return false;
+	if (st == VKART_WRIMAGE_ERR_ERASE) {
+		*res = VKART_JOB_ERR_ERASE;
+		return true;
+	}
+	if (job->off == job->len) return true;
+
+	uint32_t todo = job->len - job->off;
+	if (todo > JOB_SLICE_WORDS) todo = JOB_SLICE_WORDS;
+
+	uint32_t pos = vkart_wrimage_pos();
+	st = vkart_wrimage_next(job->src + job->off, todo);
+	switch (st) {
+	case VKART_WRIMAGE_BUSY: // an erase got in the way, take what it did
+		job->off += vkart_wrimage_pos() - pos;
+		return false;
+	case VKART_WRIMAGE_MORE:
+		job->off += todo;
+		*res = VKART_JOB_OK;
+		return job->off == job->len;
+	case VKART_WRIMAGE_END:
+		*res = VKART_JOB_END;
+		return true;
+	case VKART_WRIMAGE_ERR_PROG:
+		*res = VKART_JOB_ERR_PROG;
+		return true;
+	default:
+		*res = VKART_JOB_ERR_ERASE;
+		return true;
+	}
+}
+static bool step_erase(struct vkart_job* job, enum vkart_job_result* res) {
+	if (!job->started) {
+		// some other erase may still be running, wait for it first
+		if (vkart_erase_poll() == VKART_ERASE_BUSY) return false;
+		if (!vkart_erase_start(&job->addr, 1)) {
+			*res = VKART_JOB_ERR_ERASE;
+			return true;
+		}
+		job->started = true;
+	}
+
+	enum vkart_erase_status st = vkart_erase_poll();
+	if (st == VKART_ERASE_BUSY) return false;
+
+	*res = (st == VKART_ERASE_DONE) ? VKART_JOB_OK : VKART_JOB_ERR_ERASE;
+	return true;
+}
+// the read engine slices it up itself, and with DMA the main loop keeps
+// running while the words come in
+static bool step_read(struct vkart_job* job, enum vkart_job_result* res) {
+	if (!job->started) {
+		vkart_read_start(job->addr, job->dst, job->len);
+		job->started = true;
+	}
+	if (!vkart_read_poll()) return false;
+
+	*res = VKART_JOB_OK;
+	return true;
+}
+// a readback slice or a write-back slice per call, see vkart_wrimage_drain()
+static bool step_flush(struct vkart_job* job, enum vkart_job_result* res) {
+	(void)job;
+	if (!vkart_wrimage_drain()) return false;
+
+	*res = VKART_JOB_OK;
+	return true;
+}
+
+void vkart_job_task(void) {
+	if (!q_count) return;
+
+	struct vkart_job* job = queue[q_head];
+	enum vkart_job_result res = VKART_JOB_OK;
+	bool done;
+
+	switch (job->type) {
+	case VKART_JOB_PROGRAM: done = step_program(job, &res); break;
+	case VKART_JOB_ERASE:   done = step_erase(job, &res);   break;
+	case VKART_JOB_READ:    done = step_read(job, &res);    break;
+	case VKART_JOB_FLUSH:   done = step_flush(job, &res);   break;
+	default:
+		iprintf("[vkart] job: bad type %d\r\n", job->type);
+		done = true;
+		res = VKART_JOB_ERR_PROG;
+		break;
+	}
+
+	if (done) complete(job, res);
+}
@@ -0,0 +1,85 @@
+// host microbenchmark: slicing-by-8 crc32_sw() against the byte-at-a-time
+// loop crc32() used to be. build with make -C tools, run ./tools/crc32_bench
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "crc32_sw.h"
+#include "crc32_tables.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define HAVE_CYCLES 1
+#endif
+
+#define BUF_SIZE 4096 /* one DFU transfer */
+#define ROUNDS 20000
+
+static uint32_t crc32_bytewise(uint32_t start, const void* addr, uint32_t len) {
+	const uint8_t* data = addr;
+	uint32_t crc = start ^ 0xFFFFFFFFu;
+	for (; len; --len) {
+		crc = (crc >> 8) ^ crc32_tables[0][(crc & 0xFF) ^ *data];
+		++data;
+	}
+
+	return (crc ^ 0xFFFFFFFFu);
+}
+
+static uint64_t now_ns(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t)ts.tv_sec * 1000000000u + ts.tv_nsec;
+}
+
+static void run(const char* name, uint32_t (*fn)(uint32_t, const void*, uint32_t),
+		const uint8_t* buf, uint32_t* out) {
+	uint32_t crc = 0;
+	uint64_t t0 = now_ns();
+#ifdef HAVE_CYCLES
+	uint64_t c0 = __rdtsc();
+#endif
+	for (int r = 0; r < ROUNDS; r++) crc = fn(crc, buf, BUF_SIZE);
+#ifdef HAVE_CYCLES
+	uint64_t cycles = __rdtsc() - c0;
+#endif
+	uint64_t ns = now_ns() - t0;
+	double bytes = (double)BUF_SIZE * ROUNDS;
+
+	printf("%-12s %8.1f MB/s", name, bytes / ns * 1000.0);
+#ifdef HAVE_CYCLES
+	printf(", %.2f bytes/cycle (TSC)", bytes / cycles);
+#endif
+	printf(", crc %08x\n", crc);
+	*out = crc;
+}
+
+int main(void) {
+	static uint32_t words[BUF_SIZE / 4 + 1];
+	uint8_t* buf = (uint8_t*)words;
+	uint32_t a, b;
+
+	srand(1);
+	for (size_t i = 0; i < sizeof words; i++) buf[i] = rand();
+
+	if (crc32_sw(0, "123456789", 9) != 0xCBF43926u) {
+		printf("crc32_sw: wrong check value\n");
+		return 1;
+	}
+	for (uint32_t off = 0; off < 4; off++) {
+		for (uint32_t len = 0; len < 64; len++) {
+			if (crc32_sw(0x1234, buf + off, len) != crc32_bytewise(0x1234, buf + off, len)) {
+				printf("crc32_sw: mismatch at offset %u, length %u\n", off, len);
+				return 1;
+			}
+		}
+	}
+
+	run("bytewise", crc32_bytewise, buf, &a);
+	run("slicing-by-8", crc32_sw, buf, &b);
+
+	return a != b;
+}
@@ -0,0 +1,35 @@
+// prints the slicing-by-8 tables for src/crc32_sw.c, run by the build
+
+#include <stdint.h>
+#include <stdio.h>
+
+int main(void) {
+	static uint32_t t[8][256];
+
+	// reflected CRC-32, polynomial 0x04C11DB7
+	for (uint32_t i = 0; i < 256; i++) {
+		uint32_t c = i;
+		for (int j = 0; j < 8; j++)
+			c = (c >> 1) ^ ((c & 1) ? 0xEDB88320u : 0);
+		t[0][i] = c;
+	}
+	// t[k][i]: byte i followed by k zero bytes
+	for (int k = 1; k < 8; k++) {
+		for (uint32_t i = 0; i < 256; i++)
+			t[k][i] = (t[k-1][i] >> 8) ^ t[0][t[k-1][i] & 0xff];
+	}
+
+	printf("/* generated by tools/crc32_gen.c, don't edit */\n\n");
+	printf("static const uint32_t crc32_tables[8][256] = {\n");
+	for (int k = 0; k < 8; k++) {
+		printf("\t{\n");
+		for (uint32_t i = 0; i < 256; i++) {
+			printf("%s0x%08lx,%s", (i & 7) ? " " : "\t\t", (unsigned long)t[k][i],
+					((i & 7) == 7) ? "\n" : "");
+		}
+		printf("\t},\n");
+	}
+	printf("};\n");
+
+	return 0;
+}